@@ -20,6 +20,9 @@
    THE SOFTWARE.
 */
 
+#include <direct/clock.h>
+#include <direct/filesystem.h>
+#include <direct/thread.h>
 #include <direct/util.h>
 #include <directfb.h>
 
@@ -45,8 +48,14 @@ static char **fontfile_list;
 static int    fontfile_count;
 
 /* command line options */
-static int width  = 0;
-static int height = 0;
+static int         width         = 0;
+static int         height        = 0;
+static int         layout_passes = 0;
+static const char *layout_corpus = NULL;
+static int         warmup        = 0;
+static int         compare       = 0;
+static int         compare_sizes[8];
+static int         compare_count = 0;
 
 /**********************************************************************************************************************/
 
@@ -69,6 +78,22 @@ static int glyphs_per_yline  = 16;
 
 /**********************************************************************************************************************/
 
+/* font warmed up at startup */
+typedef struct {
+     DirectThread       *thread;
+     const char         *fontfile;
+     DFBFontDescription  fdsc;
+     IDirectFBFont      *font;
+     long long           time;
+} WarmFont;
+
+static WarmFont    *warm_fonts;
+static DirectMutex  warm_lock;
+static int          warm_pending;
+static long long    warm_start;
+
+/**********************************************************************************************************************/
+
 static const struct {
      char *key;
      char *description;
@@ -91,6 +116,148 @@ static const struct {
      { "ESC",        "Exit"}
 };
 
+static void page_font_description( const char *fontfile, DFBFontDescription *fdsc )
+{
+     fdsc->flags  = DFDESC_HEIGHT;
+     fdsc->height = 16;
+
+     if (!strstr( fontfile, ".dgiff" )) {
+          fdsc->flags      |= DFDESC_ATTRIBUTES;
+          fdsc->height      = 9 * (height * 7 / 8) / glyphs_per_yline / 16;
+          fdsc->attributes  = antialias ? 0 : DFFA_MONOCHROME;
+          fdsc->attributes |= unicode_mode ? 0 : DFFA_NOCHARMAP;
+     }
+}
+
+static void *warmup_thread( DirectThread *thread, void *arg )
+{
+     WarmFont     *warm = arg;
+     long long     t0;
+     int           i;
+     int           advance;
+     DFBRectangle  rect;
+
+     t0 = direct_clock_get_micros();
+
+     /* open the font and rasterize the glyphs of the first page into the glyph cache */
+     if (dfb->CreateFont( dfb, warm->fontfile, &warm->fdsc, &warm->font ) == DFB_OK) {
+          for (i = 0; i < GLYPHS_PER_PAGE; i++)
+               warm->font->GetGlyphExtents( warm->font, i, &rect, &advance );
+     }
+
+     warm->time = direct_clock_get_micros() - t0;
+
+     direct_mutex_lock( &warm_lock );
+
+     /* the last thread reports the total warm-up time */
+     if (--warm_pending == 0) {
+          long long total = direct_clock_get_micros() - warm_start;
+          long long sum   = 0;
+
+          for (i = 0; i < fontfile_count; i++) {
+               printf( "Warm-up %s: %lld.%03lld ms%s\n", warm_fonts[i].fontfile,
+                       warm_fonts[i].time / 1000, warm_fonts[i].time % 1000, warm_fonts[i].font ? "" : " (failed)" );
+
+               sum += warm_fonts[i].time;
+          }
+
+          printf( "Warm-up of %d fonts (%d glyphs each) on %ld cores: %lld.%03lld ms (%lld.%03lld ms sequential, "
+                  "speedup %.2f)\n", fontfile_count, GLYPHS_PER_PAGE, sysconf( _SC_NPROCESSORS_ONLN ),
+                  total / 1000, total % 1000, sum / 1000, sum % 1000, total ? (double) sum / total : 0.0 );
+     }
+
+     direct_mutex_unlock( &warm_lock );
+
+     return NULL;
+}
+
+static void start_warmup()
+{
+     int i;
+
+     warm_fonts = D_CALLOC( fontfile_count, sizeof(WarmFont) );
+     if (!warm_fonts) {
+          D_OOM();
+          return;
+     }
+
+     direct_mutex_init( &warm_lock );
+
+     warm_pending = fontfile_count;
+     warm_start   = direct_clock_get_micros();
+
+     /* one thread per font */
+     for (i = 0; i < fontfile_count; i++) {
+          warm_fonts[i].fontfile = fontfile_list[i];
+
+          page_font_description( fontfile_list[i], &warm_fonts[i].fdsc );
+     }
+
+     for (i = 0; i < fontfile_count; i++)
+          warm_fonts[i].thread = direct_thread_create( DTT_DEFAULT, warmup_thread, &warm_fonts[i], "Font Warm-up" );
+}
+
+static void finish_warmup( WarmFont *warm )
+{
+     if (warm->thread) {
+          direct_thread_join( warm->thread );
+          direct_thread_destroy( warm->thread );
+          warm->thread = NULL;
+     }
+}
+
+static void stop_warmup()
+{
+     int i;
+
+     if (!warm_fonts)
+          return;
+
+     for (i = 0; i < fontfile_count; i++) {
+          finish_warmup( &warm_fonts[i] );
+
+          if (warm_fonts[i].font)
+               warm_fonts[i].font->Release( warm_fonts[i].font );
+     }
+
+     direct_mutex_deinit( &warm_lock );
+
+     D_FREE( warm_fonts );
+     warm_fonts = NULL;
+}
+
+static IDirectFBFont *lookup_warm_font( const char *fontfile, const DFBFontDescription *fdsc )
+{
+     int i;
+
+     if (!warm_fonts)
+          return NULL;
+
+     for (i = 0; i < fontfile_count; i++) {
+          WarmFont *warm = &warm_fonts[i];
+
+          if (warm->fontfile != fontfile)
+               continue;
+
+          /* the warmed up font is only usable with the same description */
+          if (warm->fdsc.flags  != fdsc->flags  ||
+              warm->fdsc.height != fdsc->height ||
+              ((fdsc->flags & DFDESC_ATTRIBUTES) && warm->fdsc.attributes != fdsc->attributes))
+               return NULL;
+
+          finish_warmup( warm );
+
+          if (warm->font)
+               warm->font->AddRef( warm->font );
+
+          return warm->font;
+     }
+
+     return NULL;
+}
+
+/**********************************************************************************************************************/
+
 static void render_help_page( const char *fontfile )
 {
      DFBFontDescription  fdsc;
@@ -147,15 +314,12 @@ static void render_font_page( const char *fontfile, unsigned int first_char )
 
      surface->SetFont( surface, fixedfont );
 
-     /* load font */
-     if (!strstr( fontfile, ".dgiff" )) {
-          fdsc.flags      |= DFDESC_ATTRIBUTES;
-          fdsc.height      = 9 * bheight / glyphs_per_yline / 16;
-          fdsc.attributes  = antialias ? 0 : DFFA_MONOCHROME;
-          fdsc.attributes |= unicode_mode ? 0 : DFFA_NOCHARMAP;
-     }
+     /* load font, reusing the one warmed up at startup if any */
+     page_font_description( fontfile, &fdsc );
 
-     if (dfb->CreateFont( dfb, fontfile, &fdsc, &font ) != DFB_OK) {
+     font = lookup_warm_font( fontfile, &fdsc );
+
+     if (!font && dfb->CreateFont( dfb, fontfile, &fdsc, &font ) != DFB_OK) {
           static const char *msg = "failed opening '";
           char               text[strlen( msg ) + strlen( fontfile ) + 2];
 
@@ -305,8 +469,395 @@ static void render_font_page( const char *fontfile, unsigned int first_char )
 
 /**********************************************************************************************************************/
 
+/* built-in multilingual corpus used by the layout benchmark */
+static const char *builtin_corpus[] = {
+     "The quick brown fox jumps over the lazy dog. Evening news: regional weather stays mild with scattered showers "
+     "in the north, while the coast expects sunshine and light winds through the weekend.",
+     "Portez ce vieux whisky au juge blond qui fume. Programme de la soirée : journal télévisé, documentaire sur les "
+     "régions côtières, puis film policier en version originale sous-titrée.",
+     "Victor jagt zwölf Boxkämpfer quer über den großen Sylter Deich. Heute Abend im Programm: Nachrichten, "
+     "Wetterbericht und eine Reportage über die Fischerei an der Nordseeküste.",
+     "El veloz murciélago hindú comía feliz cardillo y kiwi. La cigüeña tocaba el saxofón detrás del palenque de "
+     "paja mientras el público esperaba el noticiero de las nueve.",
+     "Ξεσκεπάζω την ψυχοφθόρα βδελυγμία. Το βραδινό δελτίο ειδήσεων ακολουθεί η πρόγνωση του καιρού και μια "
+     "ταινία μικρού μήκους για τα νησιά του Αιγαίου.",
+     "Съешь же ещё этих мягких французских булок, да выпей чаю. В эфире: новости, прогноз погоды на выходные и "
+     "документальный фильм о северных морях.",
+     "Pchnąć w tę łódź jeża lub ośm skrzyń fig. Wieczorny serwis informacyjny, następnie prognoza pogody i "
+     "transmisja koncertu z filharmonii.",
+     "Příliš žluťoučký kůň úpěl ďábelské ódy. Večerní zprávy, předpověď počasí a dokument o horských "
+     "železnicích ve střední Evropě.",
+     "Pijamalı hasta yağız şoföre çabucak güvendi. Akşam haberleri, hava durumu ve Karadeniz kıyılarını "
+     "anlatan belgesel birazdan ekranlarınızda.",
+     "Árvíztűrő tükörfúrógép. Az esti híradót követően időjárás-jelentés, majd portréfilm egy balatoni "
+     "halászcsaládról.",
+};
+
+/* paragraph of the layout corpus */
+typedef struct {
+     const char *text;
+     int         length;
+} Paragraph;
+
+static Paragraph *paragraphs;
+static int        paragraph_count;
+
+static void *corpus_data;
+static size_t corpus_length;
+
+static DFBResult load_layout_corpus()
+{
+     int i;
+
+     if (layout_corpus) {
+          DirectFile      fd;
+          DirectFileInfo  info;
+          const char     *text, *end;
+
+          if (direct_file_open( &fd, layout_corpus, O_RDONLY, 0 ) == DR_OK) {
+               direct_file_get_info( &fd, &info );
+               corpus_length = info.size;
+               if (corpus_length)
+                    direct_file_map( &fd, NULL, 0, corpus_length, DFP_READ, &corpus_data );
+               direct_file_close( &fd );
+          }
+
+          if (!corpus_data) {
+               fprintf( stderr, "Failed to load layout corpus '%s', using built-in corpus!\n", layout_corpus );
+          }
+          else {
+               /* one paragraph per non-empty line */
+               end = (const char*) corpus_data + corpus_length;
+
+               for (text = corpus_data; text < end; text++) {
+                    if (*text == '\n')
+                         paragraph_count++;
+               }
+
+               paragraphs = D_CALLOC( paragraph_count + 1, sizeof(Paragraph) );
+               if (!paragraphs)
+                    return D_OOM();
+
+               paragraph_count = 0;
+
+               for (text = corpus_data; text < end;) {
+                    const char *eol = memchr( text, '\n', end - text ) ?: end;
+
+                    if (eol > text) {
+                         paragraphs[paragraph_count].text   = text;
+                         paragraphs[paragraph_count].length = eol - text;
+                         paragraph_count++;
+                    }
+
+                    text = eol + 1;
+               }
+
+               if (paragraph_count)
+                    return DFB_OK;
+
+               D_FREE( paragraphs );
+          }
+     }
+
+     paragraphs = D_CALLOC( D_ARRAY_SIZE(builtin_corpus), sizeof(Paragraph) );
+     if (!paragraphs)
+          return D_OOM();
+
+     paragraph_count = D_ARRAY_SIZE(builtin_corpus);
+
+     for (i = 0; i < paragraph_count; i++) {
+          paragraphs[i].text   = builtin_corpus[i];
+          paragraphs[i].length = strlen( builtin_corpus[i] );
+     }
+
+     return DFB_OK;
+}
+
+static void unload_layout_corpus()
+{
+     if (paragraphs)
+          D_FREE( paragraphs );
+
+     if (corpus_data)
+          direct_file_unmap( corpus_data, corpus_length );
+}
+
+/* length of the longest prefix of a word that fits, but at least one UTF-8 character */
+static int force_break( IDirectFBFont *font, const char *text, int length, int max_width )
+{
+     int fit  = 0;
+     int next = 0;
+     int width;
+
+     while (next < length) {
+          next++;
+          while (next < length && (text[next] & 0xc0) == 0x80)
+               next++;
+
+          font->GetStringWidth( font, text, next, &width );
+
+          if (width > max_width)
+               break;
+
+          fit = next;
+     }
+
+     return fit ?: next;
+}
+
+static void run_layout_benchmark( const char *fontfile )
+{
+     DFBFontDescription  fdsc;
+     IDirectFBFont      *font;
+     int                 font_height;
+     int                 xborder, yborder;
+     int                 max_width;
+     int                 pass, i;
+     int                 y;
+     long long           t0;
+     long long           measure_time = 0;
+     long long           draw_time    = 0;
+     long long           lines        = 0;
+     long long           bytes        = 0;
+     long long           forced       = 0;
+     long long           total;
+
+     xborder   = width / 16;
+     yborder   = height / 16;
+     max_width = width - 2 * xborder;
+
+     fdsc.flags  = DFDESC_HEIGHT;
+     fdsc.height = MAX( height / 30, 8 );
+
+     if (dfb->CreateFont( dfb, fontfile, &fdsc, &font ) != DFB_OK) {
+          fprintf( stderr, "Failed opening '%s'!\n", fontfile );
+          return;
+     }
+
+     font->GetHeight( font, &font_height );
+
+     surface->SetFont( surface, font );
+
+     surface->Clear( surface, 0xff, 0xff, 0xff, 0xff );
+     surface->SetColor( surface, 0x00, 0x00, 0x00, 0xff );
+
+     y = yborder;
+
+     for (pass = 0; pass < layout_passes; pass++) {
+          for (i = 0; i < paragraph_count; i++) {
+               const char *line   = paragraphs[i].text;
+               int         remain = paragraphs[i].length;
+               int         line_width;
+               int         line_length;
+               const char *next_line;
+
+               while (remain > 0) {
+                    /* measure: single line fast path, word wrap otherwise */
+                    t0 = direct_clock_get_micros();
+
+                    font->GetStringWidth( font, line, remain, &line_width );
+
+                    if (line_width <= max_width) {
+                         line_length = remain;
+                         next_line   = NULL;
+                    }
+                    else {
+                         font->GetStringBreak( font, line, remain, max_width, &line_width, &line_length, &next_line );
+
+                         /* a word wider than the layout, break it between characters */
+                         if (next_line == line || line_length <= 0) {
+                              line_length = force_break( font, line, remain, max_width );
+                              next_line   = line_length < remain ? line + line_length : NULL;
+                              forced++;
+                         }
+                    }
+
+                    measure_time += direct_clock_get_micros() - t0;
+
+                    /* new page */
+                    if (y + font_height > height - yborder) {
+                         t0 = direct_clock_get_micros();
+
+                         surface->Flip( surface, NULL, DSFLIP_NONE );
+                         dfb->WaitIdle( dfb );
+
+                         draw_time += direct_clock_get_micros() - t0;
+
+                         surface->Clear( surface, 0xff, 0xff, 0xff, 0xff );
+                         surface->SetColor( surface, 0x00, 0x00, 0x00, 0xff );
+
+                         y = yborder;
+                    }
+
+                    /* draw */
+                    t0 = direct_clock_get_micros();
+
+                    surface->DrawString( surface, line, line_length, xborder, y, DSTF_TOPLEFT );
+
+                    draw_time += direct_clock_get_micros() - t0;
+
+                    lines++;
+                    bytes += line_length;
+                    y     += font_height;
+
+                    if (!next_line || next_line == line)
+                         break;
+
+                    remain -= next_line - line;
+                    line    = next_line;
+               }
+
+               /* paragraph spacing */
+               y += font_height / 2;
+          }
+     }
+
+     t0 = direct_clock_get_micros();
+
+     surface->Flip( surface, NULL, DSFLIP_NONE );
+     dfb->WaitIdle( dfb );
+
+     draw_time += direct_clock_get_micros() - t0;
+
+     font->Release( font );
+
+     total = measure_time + draw_time;
+
+     printf( "%s (%d pixels, %d pixels wide):\n", fontfile, fdsc.height, max_width );
+     printf( "  Lines:       %lld (%lld bytes, %d passes over %d paragraphs, %lld words broken)\n",
+             lines, bytes, layout_passes, paragraph_count, forced );
+     printf( "  Total:       %lld.%03lld ms, %.1f lines/s\n",
+             total / 1000, total % 1000, total ? lines * 1000000.0 / total : 0.0 );
+     printf( "  Measurement: %lld.%03lld ms (%.1f%%), %.2f us/line\n",
+             measure_time / 1000, measure_time % 1000, total ? measure_time * 100.0 / total : 0.0,
+             lines ? (double) measure_time / lines : 0.0 );
+     printf( "  Drawing:     %lld.%03lld ms (%.1f%%), %.2f us/line\n",
+             draw_time / 1000, draw_time % 1000, total ? draw_time * 100.0 / total : 0.0,
+             lines ? (double) draw_time / lines : 0.0 );
+}
+
+/**********************************************************************************************************************/
+
+static void compare_font_mode( const char *fontfile, int size, int monochrome )
+{
+     DFBFontDescription  fdsc;
+     IDirectFBFont      *font;
+     int                 bwidth, bheight;
+     int                 xborder, yborder;
+     int                 ascender;
+     int                 i, j, n;
+     int                 glyphs = 0;
+     long long           bytes  = 0;
+     long long           bytes1 = 0;
+     long long           t0;
+     long long           raster_time;
+     long long           blit_time;
+     char                label[64];
+
+     bwidth  = width * 7 / 8;
+     bheight = height * 7 / 8;
+
+     xborder = (width - bwidth) / 2;
+     yborder = (height - bheight) / 2;
+
+     fdsc.flags      = DFDESC_HEIGHT | DFDESC_ATTRIBUTES;
+     fdsc.height     = size;
+     fdsc.attributes = monochrome ? DFFA_MONOCHROME : DFFA_NONE;
+
+     if (dfb->CreateFont( dfb, fontfile, &fdsc, &font ) != DFB_OK) {
+          fprintf( stderr, "Failed opening '%s'!\n", fontfile );
+          return;
+     }
+
+     font->GetAscender( font, &ascender );
+
+     /* rasterization: the first access of each glyph renders it into the glyph cache */
+     t0 = direct_clock_get_micros();
+
+     for (i = 0; i < GLYPHS_PER_PAGE; i++) {
+          DFBRectangle rect;
+          int          advance;
+
+          if (font->GetGlyphExtents( font, 0x20 + i, &rect, &advance ) != DFB_OK)
+               continue;
+
+          /* the glyph cache uses the DirectFB font format (A8 by default) in both modes, monochrome glyphs only
+             take 1 bit per pixel if font-format=A1 is set, which is estimated separately */
+          if (rect.w > 0 && rect.h > 0) {
+               glyphs++;
+               bytes  += rect.w * rect.h;
+               bytes1 += (rect.w + 7) / 8 * rect.h;
+          }
+     }
+
+     raster_time = direct_clock_get_micros() - t0;
+
+     /* blit: draw the cached glyphs of the page several times */
+     surface->SetFont( surface, font );
+     surface->Clear( surface, 0xff, 0xff, 0xff, 0xff );
+     surface->SetColor( surface, 0x00, 0x00, 0x00, 0xff );
+
+     dfb->WaitIdle( dfb );
+
+     t0 = direct_clock_get_micros();
+
+     for (n = 0; n < 10; n++) {
+          for (j = 0; j < glyphs_per_yline; j++) {
+               for (i = 0; i < glyphs_per_xline; i++) {
+                    int basex = (2 * i + 1) * bwidth / glyphs_per_xline / 2 + xborder;
+                    int basey = j * bheight / glyphs_per_yline + yborder + ascender;
+
+                    surface->DrawGlyph( surface, 0x20 + i + j * glyphs_per_xline, basex, basey, DSTF_LEFT );
+               }
+          }
+     }
+
+     dfb->WaitIdle( dfb );
+
+     blit_time = (direct_clock_get_micros() - t0) / 10;
+
+     snprintf( label, sizeof(label), "%d pixels, %s", size, monochrome ? "monochrome" : "antialiased" );
+
+     surface->SetColor( surface, 0xa0, 0xa0, 0xa0, 0xff );
+     surface->DrawString( surface, label, -1, width / 2, 10, DSTF_TOPCENTER );
+     surface->Flip( surface, NULL, DSFLIP_NONE );
+
+     printf( "  %4d  %-11s  %5d  %8lld.%03lld  %8.1f  %8lld  %8.1f  %8lld.%03lld",
+             size, monochrome ? "monochrome" : "antialiased", glyphs, raster_time / 1000, raster_time % 1000,
+             glyphs ? (double) raster_time / glyphs : 0.0, bytes, glyphs ? (double) bytes / glyphs : 0.0,
+             blit_time / 1000, blit_time % 1000 );
+
+     if (monochrome)
+          printf( "  %9lld\n", bytes1 );
+     else
+          printf( "  %9s\n", "-" );
+
+     font->Release( font );
+}
+
+static void run_compare( const char *fontfile )
+{
+     int i;
+
+     printf( "%s (%d glyphs from U+0020):\n", fontfile, GLYPHS_PER_PAGE );
+     printf( "  Size  Mode         Glyphs    Raster ms  us/glyph  A8 bytes  B/glyph    Blit ms  A1 bytes*\n" );
+
+     for (i = 0; i < compare_count; i++) {
+          compare_font_mode( fontfile, compare_sizes[i], 0 );
+          compare_font_mode( fontfile, compare_sizes[i], 1 );
+     }
+
+     printf( "  * estimated from the glyph extents, for monochrome glyphs cached with font-format=A1\n" );
+}
+
+/**********************************************************************************************************************/
+
 static void dfb_shutdown()
 {
+     stop_warmup();
+
+     unload_layout_corpus();
+
      if (event_buffer) event_buffer->Release( event_buffer );
      if (surface)      surface->Release( surface );
      if (window)       window->Release( window );
@@ -320,6 +871,11 @@ static void print_usage()
      printf( "Usage: df_font_sample [options] files\n\n" );
      printf( "Options:\n\n" );
      printf( "  --size=<width>x<height>  Set windows size.\n" );
+     printf( "  --layout[=<passes>]      Run the paragraph layout benchmark and exit (default: 10 passes).\n" );
+     printf( "  --corpus=<textfile>      Use the paragraphs (one per line) of a text file for the layout benchmark.\n" );
+     printf( "  --warmup                 Pre-rasterize the first page of each font in parallel at startup.\n" );
+     printf( "  --compare[=<sizes>]      Compare antialiased and monochrome rendering at several sizes and exit\n" );
+     printf( "                           (comma separated pixel sizes, default: 12,16,24,32,48).\n" );
      printf( "  --help                   Print usage information.\n" );
      printf( "  --dfb-help               Output DirectFB usage information.\n\n" );
      printf( "Use:\n" );
@@ -365,6 +921,36 @@ int main( int argc, char *argv[] )
                if (!strncmp( option, "-size=", sizeof("-size=") - 1 )) {
                     option += sizeof("-size=") - 1;
                     sscanf( option, "%dx%d", &width, &height );
+               } else
+               if (!strcmp( option, "-layout" )) {
+                    layout_passes = 10;
+               } else
+               if (!strncmp( option, "-layout=", sizeof("-layout=") - 1 )) {
+                    option += sizeof("-layout=") - 1;
+                    layout_passes = MAX( atoi( option ), 1 );
+               } else
+               if (!strncmp( option, "-corpus=", sizeof("-corpus=") - 1 )) {
+                    option += sizeof("-corpus=") - 1;
+                    layout_corpus = option;
+               } else
+               if (!strcmp( option, "-warmup" )) {
+                    warmup = 1;
+               } else
+               if (!strcmp( option, "-compare" )) {
+                    compare = 1;
+               } else
+               if (!strncmp( option, "-compare=", sizeof("-compare=") - 1 )) {
+                    option += sizeof("-compare=") - 1;
+                    compare = 1;
+                    while (*option && compare_count < D_ARRAY_SIZE(compare_sizes)) {
+                         int size = strtol( option, &option, 10 );
+
+                         if (size > 0)
+                              compare_sizes[compare_count++] = size;
+
+                         if (*option)
+                              option++;
+                    }
                }
           }
           else {
@@ -379,6 +965,12 @@ int main( int argc, char *argv[] )
           return 1;
      }
 
+     if (layout_passes && compare) {
+          fprintf( stderr, "The options --layout and --compare can not be combined!\n\n" );
+          print_usage();
+          return 1;
+     }
+
      /* create the main interface */
      DFBCHECK(DirectFBCreate( &dfb ));
 
@@ -400,6 +992,10 @@ int main( int argc, char *argv[] )
      wdsc.width  = width;
      wdsc.height = height;
 
+     /* warm up fonts in the background while the window is being set up */
+     if (warmup && !layout_passes && !compare)
+          start_warmup();
+
      DFBCHECK(layer->CreateWindow( layer, &wdsc, &window ));
      DFBCHECK(window->GetSurface( window, &surface ));
 
@@ -409,6 +1005,32 @@ int main( int argc, char *argv[] )
      window->SetOpacity( window, 0xff );
      window->RequestFocus( window );
 
+     /* paragraph layout benchmark */
+     if (layout_passes) {
+          if (load_layout_corpus())
+               return 1;
+
+          for (i = 0; i < fontfile_count; i++)
+               run_layout_benchmark( fontfile_list[i] );
+
+          return 0;
+     }
+
+     /* antialiased versus monochrome comparison */
+     if (compare) {
+          if (!compare_count) {
+               static const int default_sizes[] = { 12, 16, 24, 32, 48 };
+
+               for (i = 0; i < D_ARRAY_SIZE(default_sizes); i++)
+                    compare_sizes[compare_count++] = default_sizes[i];
+          }
+
+          for (i = 0; i < fontfile_count; i++)
+               run_compare( fontfile_list[i] );
+
+          return 0;
+     }
+
      /* main loop */
      while (1) {
           DFBWindowEvent  evt;
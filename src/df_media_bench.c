@@ -0,0 +1,891 @@
+/*
+   This file is part of DirectFB-media-samples.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <direct/clock.h>
+#include <direct/filesystem.h>
+#include <direct/util.h>
+#include <directfb.h>
+#ifdef HAVE_FUSIONSOUND
+#include <fusionsound.h>
+#endif
+
+/* macro for a safe call to DirectFB functions */
+#define DFBCHECK(x)                                                   \
+     do {                                                             \
+          DFBResult ret = x;                                          \
+          if (ret != DFB_OK) {                                        \
+               fprintf( stderr, "%s <%d>:\n\t", __FILE__, __LINE__ ); \
+               DirectFBErrorFatal( #x, ret );                         \
+          }                                                           \
+     } while (0)
+
+/* DirectFB interfaces */
+static IDirectFB    *dfb   = NULL;
+#ifdef HAVE_FUSIONSOUND
+static IFusionSound *sound = NULL;
+#endif
+
+/* media corpus */
+static const char *image_files[] = {
+     "IM.avif", "IM.bmp", "IM.dfiff", "IM.exr", "IM.gif", "IM.jp2",
+     "IM.jpg", "IM.jxl", "IM.png", "IM.svg", "IM.tiff", "IM.webp"
+};
+
+static const char *video_files[] = { "IM.m2v", "linux.mng", "fishing.swf" };
+
+static const char *font_files[]  = { "FreeMono.ttf", "FreeSans.ttf", "FreeSerif.ttf" };
+
+/* text drawn by the font scenario */
+static const char *font_text = "The quick brown fox jumps over the lazy dog 0123456789";
+
+/* command line options */
+static const char *data_dir   = "data";
+static const char *output     = NULL;
+static const char *scenarios  = NULL;
+static int         iterations = 5;
+static int         duration   = 3;
+
+/* JSON report */
+static FILE *report   = NULL;
+static int   items    = 0;
+static int   fields   = 0;
+static int   failures = 0;
+
+/**********************************************************************************************************************/
+
+static void json_string( const char *str )
+{
+     fputc( '"', report );
+
+     for (; *str; str++) {
+          if (*str == '"' || *str == '\\')
+               fprintf( report, "\\%c", *str );
+          else if ((unsigned char) *str < 0x20)
+               fprintf( report, "\\u%04x", *str );
+          else
+               fputc( *str, report );
+     }
+
+     fputc( '"', report );
+}
+
+static void json_name( const char *name )
+{
+     fprintf( report, "%s\n        ", fields++ ? "," : "" );
+
+     json_string( name );
+
+     fprintf( report, ": " );
+}
+
+static void field_int( const char *name, long long value )
+{
+     json_name( name );
+
+     fprintf( report, "%lld", value );
+}
+
+static void field_double( const char *name, double value )
+{
+     json_name( name );
+
+     fprintf( report, "%.3f", value );
+}
+
+static void field_string( const char *name, const char *value )
+{
+     json_name( name );
+
+     json_string( value );
+}
+
+static void scenario_begin( const char *scenario, const char *file )
+{
+     fprintf( report, "%s\n    {", items++ ? "," : "" );
+
+     fields = 0;
+
+     field_string( "scenario", scenario );
+
+     if (file)
+          field_string( "file", file );
+}
+
+/* a scenario is skipped only if no provider for the format is available, a missing corpus file is a failure */
+static const char *create_status( DFBResult result )
+{
+     return (result == DFB_UNSUPPORTED || result == DFB_NOIMPL) ? "skipped" : "failed";
+}
+
+static void scenario_end( const char *status, DFBResult result )
+{
+     field_string( "status", status );
+
+     if (result)
+          field_string( "error", DirectFBErrorString( result ) );
+
+     fprintf( report, "\n    }" );
+
+     if (!strcmp( status, "failed" ))
+          failures++;
+}
+
+/**********************************************************************************************************************/
+
+static int enabled( const char *scenario )
+{
+     const char *list = scenarios;
+     size_t      len  = strlen( scenario );
+
+     if (!list)
+          return 1;
+
+     while (*list) {
+          if (!strncmp( list, scenario, len ) && (list[len] == ',' || !list[len]))
+               return 1;
+
+          list = strchr( list, ',' );
+          if (!list)
+               break;
+
+          list++;
+     }
+
+     return 0;
+}
+
+/* get the resident set size in KiB */
+static long current_rss()
+{
+     long  pages = 0;
+     FILE *f;
+
+     f = fopen( "/proc/self/statm", "r" );
+     if (f) {
+          if (fscanf( f, "%*d %ld", &pages ) != 1)
+               pages = 0;
+
+          fclose( f );
+     }
+
+     return pages * (sysconf( _SC_PAGESIZE ) / 1024);
+}
+
+static long long process_cpu()
+{
+     return direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID );
+}
+
+static void data_path( const char *file, char *path, size_t size )
+{
+     snprintf( path, size, "%s/%s", data_dir, file );
+}
+
+static long long file_size( const char *path )
+{
+     DirectFile     fd;
+     DirectFileInfo info;
+
+     if (direct_file_open( &fd, path, O_RDONLY, 0 ))
+          return 0;
+
+     direct_file_get_info( &fd, &info );
+     direct_file_close( &fd );
+
+     return info.size;
+}
+
+static void field_memory( long rss0 )
+{
+     long rss = current_rss();
+
+     field_int( "rss_kib", rss );
+     field_int( "rss_delta_kib", rss - rss0 );
+}
+
+/**********************************************************************************************************************/
+
+/* decode an image into a surface of its native size and format */
+static void bench_image( const char *file )
+{
+     DFBResult               ret;
+     DFBSurfaceDescription   sdsc;
+     IDirectFBImageProvider *provider;
+     IDirectFBSurface       *dest;
+     char                    path[1024];
+     long long               t0, open_time, cpu0, cpu;
+     long long               decode_time = 0;
+     long long               bytes;
+     long                    rss0        = current_rss();
+     int                     i;
+
+     data_path( file, path, sizeof(path) );
+
+     scenario_begin( "image", file );
+
+     t0        = direct_clock_get_micros();
+     ret       = dfb->CreateImageProvider( dfb, path, &provider );
+     open_time = direct_clock_get_micros() - t0;
+
+     if (ret) {
+          scenario_end( create_status( ret ), ret );
+          return;
+     }
+
+     provider->GetSurfaceDescription( provider, &sdsc );
+
+     ret = dfb->CreateSurface( dfb, &sdsc, &dest );
+     if (ret) {
+          provider->Release( provider );
+          scenario_end( "failed", ret );
+          return;
+     }
+
+     cpu0 = process_cpu();
+
+     for (i = 0; i < iterations && !ret; i++) {
+          t0  = direct_clock_get_micros();
+          ret = provider->RenderTo( provider, dest, NULL );
+
+          dfb->WaitIdle( dfb );
+
+          decode_time += direct_clock_get_micros() - t0;
+     }
+
+     cpu   = process_cpu() - cpu0;
+     bytes = file_size( path );
+
+     field_int( "width", sdsc.width );
+     field_int( "height", sdsc.height );
+     field_int( "bytes", bytes );
+     field_int( "iterations", i );
+     field_double( "open_ms", open_time / 1000.0 );
+     field_double( "decode_ms", decode_time / 1000.0 / i );
+     field_double( "mpixels_per_s", decode_time ? (double) sdsc.width * sdsc.height * i / decode_time : 0.0 );
+     field_double( "mbytes_per_s", decode_time ? (double) bytes * i / decode_time : 0.0 );
+     field_double( "cpu_ms", cpu / 1000.0 );
+     field_memory( rss0 );
+
+     dest->Release( dest );
+     provider->Release( provider );
+
+     scenario_end( ret ? "failed" : "ok", ret );
+}
+
+static void video_frame_cb( void *ctx )
+{
+     int *frames = ctx;
+
+     (*frames)++;
+}
+
+/* play a video into a surface for up to the benchmark duration */
+static void bench_video( const char *file )
+{
+     DFBResult               ret;
+     DFBSurfaceDescription   sdsc;
+     DFBVideoProviderStatus  status = DVSTATE_UNKNOWN;
+     IDirectFBVideoProvider *provider;
+     IDirectFBSurface       *dest;
+     char                    path[1024];
+     long long               t0, open_time, cpu0, cpu, elapsed;
+     volatile int            frames = 0;
+     long                    rss0   = current_rss();
+
+     data_path( file, path, sizeof(path) );
+
+     scenario_begin( "video", file );
+
+     t0        = direct_clock_get_micros();
+     ret       = dfb->CreateVideoProvider( dfb, path, &provider );
+     open_time = direct_clock_get_micros() - t0;
+
+     if (ret) {
+          scenario_end( create_status( ret ), ret );
+          return;
+     }
+
+     provider->GetSurfaceDescription( provider, &sdsc );
+
+     ret = dfb->CreateSurface( dfb, &sdsc, &dest );
+     if (ret) {
+          provider->Release( provider );
+          scenario_end( "failed", ret );
+          return;
+     }
+
+     provider->SetPlaybackFlags( provider, DVPLAY_NOFX );
+
+     t0   = direct_clock_get_micros();
+     cpu0 = process_cpu();
+
+     ret = provider->PlayTo( provider, dest, NULL, video_frame_cb, (void*) &frames );
+
+     while (!ret && direct_clock_get_micros() - t0 < duration * 1000000LL) {
+          usleep( 10000 );
+
+          provider->GetStatus( provider, &status );
+          if (status == DVSTATE_FINISHED)
+               break;
+     }
+
+     provider->Stop( provider );
+
+     elapsed = direct_clock_get_micros() - t0;
+     cpu     = process_cpu() - cpu0;
+
+     field_int( "width", sdsc.width );
+     field_int( "height", sdsc.height );
+     field_double( "open_ms", open_time / 1000.0 );
+     field_int( "frames", frames );
+     field_double( "play_ms", elapsed / 1000.0 );
+     field_double( "fps", elapsed ? frames * 1000000.0 / elapsed : 0.0 );
+     field_double( "cpu_ms", cpu / 1000.0 );
+     field_double( "cpu_percent", elapsed ? cpu * 100.0 / elapsed : 0.0 );
+     field_int( "finished", status == DVSTATE_FINISHED );
+     field_memory( rss0 );
+
+     dest->Release( dest );
+     provider->Release( provider );
+
+     scenario_end( ret ? "failed" : "ok", ret );
+}
+
+/* open a font, draw all printable ASCII glyphs once with a cold glyph cache, then a line of text repeatedly */
+static void bench_font( const char *file )
+{
+     DFBResult              ret;
+     DFBFontDescription     fdsc;
+     DFBSurfaceDescription  sdsc;
+     IDirectFBFont         *font;
+     IDirectFBSurface      *dest;
+     char                   path[1024];
+     char                   ascii[96];
+     long long              t0, open_time, first_time, draw_time, cpu0, cpu;
+     long                   rss0    = current_rss();
+     int                    strings = iterations * 100;
+     int                    len     = strlen( font_text );
+     int                    i;
+
+     data_path( file, path, sizeof(path) );
+
+     scenario_begin( "font", file );
+
+     fdsc.flags  = DFDESC_HEIGHT;
+     fdsc.height = 24;
+
+     t0        = direct_clock_get_micros();
+     ret       = dfb->CreateFont( dfb, path, &fdsc, &font );
+     open_time = direct_clock_get_micros() - t0;
+
+     if (ret) {
+          scenario_end( create_status( ret ), ret );
+          return;
+     }
+
+     sdsc.flags       = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+     sdsc.width       = 1024;
+     sdsc.height      = 64;
+     sdsc.pixelformat = DSPF_ARGB;
+
+     ret = dfb->CreateSurface( dfb, &sdsc, &dest );
+     if (ret) {
+          font->Release( font );
+          scenario_end( "failed", ret );
+          return;
+     }
+
+     for (i = 0; i < 95; i++)
+          ascii[i] = ' ' + i;
+
+     ascii[95] = 0;
+
+     dest->SetFont( dest, font );
+     dest->SetColor( dest, 0xcc, 0xcc, 0xcc, 0xff );
+
+     cpu0 = process_cpu();
+
+     /* rasterize the glyphs into the cache */
+     t0  = direct_clock_get_micros();
+     ret = dest->DrawString( dest, ascii, -1, 0, 0, DSTF_TOPLEFT );
+
+     dfb->WaitIdle( dfb );
+
+     first_time = direct_clock_get_micros() - t0;
+
+     /* draw from the glyph cache */
+     t0 = direct_clock_get_micros();
+
+     for (i = 0; i < strings && !ret; i++)
+          ret = dest->DrawString( dest, font_text, len, 0, 32, DSTF_TOPLEFT );
+
+     dfb->WaitIdle( dfb );
+
+     draw_time = direct_clock_get_micros() - t0;
+     cpu       = process_cpu() - cpu0;
+
+     field_int( "size", fdsc.height );
+     field_int( "bytes", file_size( path ) );
+     field_double( "open_ms", open_time / 1000.0 );
+     field_double( "first_draw_ms", first_time / 1000.0 );
+     field_int( "strings", i );
+     field_int( "glyphs", (long long) i * len );
+     field_double( "draw_ms", draw_time / 1000.0 );
+     field_double( "glyphs_per_s", draw_time ? (double) i * len * 1000000 / draw_time : 0.0 );
+     field_double( "cpu_ms", cpu / 1000.0 );
+     field_memory( rss0 );
+
+     dest->Release( dest );
+     font->Release( font );
+
+     scenario_end( ret ? "failed" : "ok", ret );
+}
+
+/* load an image or a font through a file, memory or streamed data buffer */
+static DFBResult load_from_buffer( const char *kind, const char *path, const void *data, unsigned int length, int is_font )
+{
+     DFBResult                 ret;
+     DFBDataBufferDescription  ddsc;
+     IDirectFBDataBuffer      *buffer;
+
+     if (!strcmp( kind, "file" )) {
+          ddsc.flags = DBDESC_FILE;
+          ddsc.file  = path;
+
+          ret = dfb->CreateDataBuffer( dfb, &ddsc, &buffer );
+     }
+     else if (!strcmp( kind, "memory" )) {
+          ddsc.flags         = DBDESC_MEMORY;
+          ddsc.memory.data   = data;
+          ddsc.memory.length = length;
+
+          ret = dfb->CreateDataBuffer( dfb, &ddsc, &buffer );
+     }
+     else {
+          unsigned int offset;
+
+          ret = dfb->CreateDataBuffer( dfb, NULL, &buffer );
+
+          /* all data is put in 8 KiB chunks before the provider reads it */
+          for (offset = 0; !ret && offset < length; offset += 8192)
+               ret = buffer->PutData( buffer, (const u8*) data + offset, MIN( 8192, length - offset ) );
+
+          if (!ret)
+               ret = buffer->Finish( buffer );
+     }
+
+     if (ret)
+          return ret;
+
+     if (is_font) {
+          DFBFontDescription  fdsc;
+          IDirectFBFont      *font;
+          int                 width;
+
+          fdsc.flags  = DFDESC_HEIGHT;
+          fdsc.height = 24;
+
+          ret = buffer->CreateFont( buffer, &fdsc, &font );
+          if (!ret) {
+               ret = font->GetStringWidth( font, font_text, -1, &width );
+
+               font->Release( font );
+          }
+     }
+     else {
+          DFBSurfaceDescription   sdsc;
+          IDirectFBImageProvider *provider;
+          IDirectFBSurface       *dest;
+
+          ret = buffer->CreateImageProvider( buffer, &provider );
+          if (!ret) {
+               provider->GetSurfaceDescription( provider, &sdsc );
+
+               ret = dfb->CreateSurface( dfb, &sdsc, &dest );
+               if (!ret) {
+                    ret = provider->RenderTo( provider, dest, NULL );
+
+                    dfb->WaitIdle( dfb );
+
+                    dest->Release( dest );
+               }
+
+               provider->Release( provider );
+          }
+     }
+
+     buffer->Release( buffer );
+
+     return ret;
+}
+
+static void bench_databuffer( const char *kind, const char *file, int is_font )
+{
+     DFBResult       ret = DFB_OK;
+     DirectFile      fd;
+     DirectFileInfo  info;
+     char            path[1024];
+     void           *data = NULL;
+     long long       t0, load_time = 0, cpu0, cpu;
+     long            rss0 = current_rss();
+     int             i;
+
+     data_path( file, path, sizeof(path) );
+
+     scenario_begin( "databuffer", file );
+
+     field_string( "buffer", kind );
+
+     /* memory map the file as in df_databuffer */
+     ret = direct_file_open( &fd, path, O_RDONLY, 0 );
+     if (ret) {
+          scenario_end( "failed", ret );
+          return;
+     }
+
+     direct_file_get_info( &fd, &info );
+
+     ret = direct_file_map( &fd, NULL, 0, info.size, DFP_READ, &data );
+
+     direct_file_close( &fd );
+
+     if (ret) {
+          scenario_end( "failed", ret );
+          return;
+     }
+
+     cpu0 = process_cpu();
+
+     for (i = 0; i < iterations && !ret; i++) {
+          t0  = direct_clock_get_micros();
+          ret = load_from_buffer( kind, path, data, info.size, is_font );
+
+          load_time += direct_clock_get_micros() - t0;
+     }
+
+     cpu = process_cpu() - cpu0;
+
+     direct_file_unmap( data, info.size );
+
+     field_int( "bytes", info.size );
+     field_int( "iterations", i );
+     field_double( "load_ms", load_time / 1000.0 / i );
+     field_double( "mbytes_per_s", load_time ? (double) info.size * i / load_time : 0.0 );
+     field_double( "cpu_ms", cpu / 1000.0 );
+     field_memory( rss0 );
+
+     /* the first iteration tells whether a provider for the format exists */
+     scenario_end( ret ? (i == 1 ? create_status( ret ) : "failed") : "ok", ret );
+}
+
+/**********************************************************************************************************************/
+
+#ifdef HAVE_FUSIONSOUND
+static int audio_cb( int length, void *ctx )
+{
+     long long *frames = ctx;
+
+     *frames += length;
+
+     return 0;
+}
+
+/* decode the first audio track of a corpus file as fast as possible */
+static void bench_audio_decode( const char *file )
+{
+     DFBResult                  ret;
+     FSBufferDescription        bdsc;
+     FSMusicProviderStatus      status = FMSTATE_UNKNOWN;
+     IFusionSoundMusicProvider *provider;
+     IFusionSoundBuffer        *buffer;
+     char                       path[1024];
+     long long                  t0, elapsed, cpu0, cpu;
+     long long                  frames = 0;
+     long                       rss0   = current_rss();
+     double                     audio;
+
+     data_path( file, path, sizeof(path) );
+
+     scenario_begin( "audio", file );
+
+     ret = sound->CreateMusicProvider( sound, path, &provider );
+     if (ret) {
+          scenario_end( create_status( ret ), ret );
+          return;
+     }
+
+     provider->GetBufferDescription( provider, &bdsc );
+
+     ret = sound->CreateBuffer( sound, &bdsc, &buffer );
+     if (ret) {
+          provider->Release( provider );
+          scenario_end( "failed", ret );
+          return;
+     }
+
+     t0   = direct_clock_get_micros();
+     cpu0 = process_cpu();
+
+     ret = provider->PlayToBuffer( provider, buffer, audio_cb, &frames );
+     if (!ret) {
+          while (status != FMSTATE_FINISHED && status != FMSTATE_STOP) {
+               provider->WaitStatus( provider, FMSTATE_FINISHED | FMSTATE_STOP, 0 );
+               provider->GetStatus( provider, &status );
+          }
+
+          provider->Stop( provider );
+     }
+
+     elapsed = direct_clock_get_micros() - t0;
+     cpu     = process_cpu() - cpu0;
+     audio   = (double) frames / bdsc.samplerate;
+
+     field_int( "samplerate", bdsc.samplerate );
+     field_int( "channels", bdsc.channels );
+     field_int( "frames", frames );
+     field_double( "audio_s", audio );
+     field_double( "decode_ms", elapsed / 1000.0 );
+     field_double( "realtime_factor", elapsed ? audio * 1000000 / elapsed : 0.0 );
+     field_double( "cpu_ms", cpu / 1000.0 );
+     field_memory( rss0 );
+
+     buffer->Release( buffer );
+     provider->Release( provider );
+
+     scenario_end( ret ? "failed" : "ok", ret );
+}
+
+/* write a generated tone to a stream for the benchmark duration, counting underruns */
+static void bench_audio_stream()
+{
+     DFBResult            ret;
+     FSStreamDescription  sdsc;
+     IFusionSoundStream  *stream;
+     s16                  tone[1024 * 2];
+     long long            t0, elapsed, cpu0, cpu;
+     long long            frames    = 0;
+     long                 rss0      = current_rss();
+     int                  underruns = 0;
+     int                  i;
+
+     scenario_begin( "audio", NULL );
+
+     field_string( "source", "tone" );
+
+     sdsc.flags        = FSSDF_CHANNELS | FSSDF_SAMPLEFORMAT | FSSDF_SAMPLERATE;
+     sdsc.channels     = 2;
+     sdsc.sampleformat = FSSF_S16;
+     sdsc.samplerate   = 48000;
+
+     ret = sound->CreateStream( sound, &sdsc, &stream );
+     if (ret) {
+          scenario_end( create_status( ret ), ret );
+          return;
+     }
+
+     stream->GetDescription( stream, &sdsc );
+
+     /* 375 Hz triangle */
+     for (i = 0; i < 1024; i++) {
+          int phase = i % 128;
+
+          tone[i * 2] = tone[i * 2 + 1] = (phase < 64 ? phase - 32 : 96 - phase) * 256;
+     }
+
+     t0   = direct_clock_get_micros();
+     cpu0 = process_cpu();
+
+     while (!ret && frames < (long long) duration * sdsc.samplerate) {
+          int filled = 0;
+
+          stream->GetStatus( stream, &filled, NULL, NULL, NULL, NULL );
+
+          if (frames && !filled)
+               underruns++;
+
+          ret = stream->Write( stream, tone, 1024 );
+
+          frames += 1024;
+     }
+
+     if (!ret)
+          stream->Wait( stream, 0 );
+
+     elapsed = direct_clock_get_micros() - t0;
+     cpu     = process_cpu() - cpu0;
+
+     field_int( "samplerate", sdsc.samplerate );
+     field_int( "channels", sdsc.channels );
+     field_int( "frames", frames );
+     field_double( "play_ms", elapsed / 1000.0 );
+     field_double( "cpu_ms", cpu / 1000.0 );
+     field_double( "cpu_percent", elapsed ? cpu * 100.0 / elapsed : 0.0 );
+     field_int( "underruns", underruns );
+     field_memory( rss0 );
+
+     stream->Release( stream );
+
+     scenario_end( ret ? "failed" : "ok", ret );
+}
+#endif
+
+/**********************************************************************************************************************/
+
+static void dfb_shutdown()
+{
+#ifdef HAVE_FUSIONSOUND
+     if (sound) sound->Release( sound );
+#endif
+     if (dfb)   dfb->Release( dfb );
+
+     if (report && report != stdout)
+          fclose( report );
+}
+
+static void print_usage()
+{
+     printf( "DirectFB Media Benchmark\n\n" );
+     printf( "Usage: df_media_bench [options] [datadir]\n\n" );
+     printf( "Runs the image, video, font, databuffer and audio scenarios on the media corpus (default: data)\n" );
+     printf( "without any window or input, and writes one JSON report.\n\n" );
+     printf( "Options:\n\n" );
+     printf( "  --iterations=<n>       Set the number of decodes per image, font and data buffer (default 5).\n" );
+     printf( "  --duration=<seconds>   Set the maximum playback time per video and of the audio stream (default 3).\n" );
+     printf( "  --scenarios=<list>     Run only the comma separated scenarios (image,video,font,databuffer,audio).\n" );
+     printf( "  --output=<file>        Write the report to a file instead of stdout.\n" );
+     printf( "  --help                 Print usage information.\n" );
+     printf( "  --dfb-help             Output DirectFB usage information.\n" );
+#ifdef HAVE_FUSIONSOUND
+     printf( "  --fs-help              Output FusionSound usage information.\n" );
+#endif
+     printf( "\n" );
+}
+
+int main( int argc, char *argv[] )
+{
+     int       i;
+     long long t0;
+
+     /* initialize DirectFB including command line parsing */
+     DFBCHECK(DirectFBInit( &argc, &argv ));
+
+#ifdef HAVE_FUSIONSOUND
+     /* initialize FusionSound including command line parsing */
+     if (FusionSoundInit( &argc, &argv ))
+          fprintf( stderr, "Failed to initialize FusionSound, audio scenarios are skipped!\n" );
+#endif
+
+     /* parse command line */
+     for (i = 1; i < argc; i++) {
+          char *option = argv[i];
+
+          if (*option == '-') {
+               option++;
+
+               if (!strcmp( option, "-help" )) {
+                    print_usage();
+                    return 0;
+               } else
+               if (!strncmp( option, "-iterations=", sizeof("-iterations=") - 1 )) {
+                    option += sizeof("-iterations=") - 1;
+                    iterations = MAX( atoi( option ), 1 );
+               } else
+               if (!strncmp( option, "-duration=", sizeof("-duration=") - 1 )) {
+                    option += sizeof("-duration=") - 1;
+                    duration = MAX( atoi( option ), 1 );
+               } else
+               if (!strncmp( option, "-scenarios=", sizeof("-scenarios=") - 1 )) {
+                    option += sizeof("-scenarios=") - 1;
+                    scenarios = option;
+               } else
+               if (!strncmp( option, "-output=", sizeof("-output=") - 1 )) {
+                    option += sizeof("-output=") - 1;
+                    output = option;
+               }
+          }
+          else
+               data_dir = option;
+     }
+
+     report = output ? fopen( output, "w" ) : stdout;
+     if (!report) {
+          fprintf( stderr, "Failed to open report file '%s'!\n", output );
+          return 1;
+     }
+
+     /* create the main interface */
+     DFBCHECK(DirectFBCreate( &dfb ));
+
+     /* register termination function */
+     atexit( dfb_shutdown );
+
+#ifdef HAVE_FUSIONSOUND
+     /* a missing sound device only skips the audio scenarios */
+     if (enabled( "audio" ) && FusionSoundCreate( &sound ))
+          sound = NULL;
+#endif
+
+     t0 = direct_clock_get_micros();
+
+     fprintf( report, "{\n  \"benchmark\": \"df_media_bench\",\n  \"data\": " );
+     json_string( data_dir );
+     fprintf( report, ",\n  \"iterations\": %d,\n  \"duration\": %d,\n  \"scenarios\": [", iterations, duration );
+
+     if (enabled( "image" )) {
+          for (i = 0; i < D_ARRAY_SIZE(image_files); i++)
+               bench_image( image_files[i] );
+     }
+
+     if (enabled( "video" )) {
+          for (i = 0; i < D_ARRAY_SIZE(video_files); i++)
+               bench_video( video_files[i] );
+     }
+
+     if (enabled( "font" )) {
+          for (i = 0; i < D_ARRAY_SIZE(font_files); i++)
+               bench_font( font_files[i] );
+     }
+
+     if (enabled( "databuffer" )) {
+          static const char *kinds[] = { "file", "memory", "streamed" };
+
+          for (i = 0; i < D_ARRAY_SIZE(kinds); i++) {
+               bench_databuffer( kinds[i], "IM.png", 0 );
+               bench_databuffer( kinds[i], "FreeSans.ttf", 1 );
+          }
+     }
+
+#ifdef HAVE_FUSIONSOUND
+     /* the corpus has no audio-only media, the audio of the videos is decoded if a music provider supports them */
+     if (enabled( "audio" ) && sound) {
+          for (i = 0; i < D_ARRAY_SIZE(video_files); i++)
+               bench_audio_decode( video_files[i] );
+
+          bench_audio_stream();
+     }
+#endif
+
+     fprintf( report, "\n  ],\n  \"failures\": %d,\n  \"total_ms\": %.3f\n}\n", failures,
+              (direct_clock_get_micros() - t0) / 1000.0 );
+
+     return failures ? 1 : 0;
+}
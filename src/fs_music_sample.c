@@ -20,9 +20,32 @@
    THE SOFTWARE.
 */
 
+/* O_DIRECT */
+#define _GNU_SOURCE
+
+#include <direct/clock.h>
+#include <direct/hash.h>
 #include <direct/list.h>
+#include <direct/thread.h>
 #include <fusionsound.h>
+#include <alloca.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 
 /* macro for a safe call to FusionSound functions */
 #define FSCHECK(x)                                                    \
@@ -34,57 +57,6330 @@
           }                                                           \
      } while (0)
 
-/* terminal interface */
-static struct termios term;
+/* terminal interface */
+static struct termios term;
+
+/* FusionSound interfaces */
+static IFusionSound              *sound    = NULL;
+static IFusionSoundStream        *stream   = NULL;
+static IFusionSoundPlayback      *playback = NULL;
+
+/* track IDs of a media, in one array */
+typedef struct {
+     FSTrackID *ids;
+     int        count;
+     int        max;
+} TrackList;
+
+/* track index entry */
+typedef struct {
+     FSTrackID           id;
+     FSTrackDescription  desc;
+     FSStreamDescription format;
+     double              length;
+} IndexTrack;
+
+/* media index entry, valid while size and modification time of the file are unchanged */
+typedef struct _IndexEntry {
+     DirectLink          link;
+     struct _IndexEntry *next;   /* in the same hash bucket */
+
+     char               *path;
+     long long           size;
+     long long           mtime;
+     long long           probe_time;
+
+     IndexTrack         *tracks;
+     int                 num_tracks;
+     int                 max_tracks;
+
+     int                 valid;
+     int                 queued;
+} IndexEntry;
+
+/* media struct */
+typedef struct {
+     const char *mrl;
+     int         id;          /* index in the media array */
+
+     TrackList   tracks;
+
+     IndexEntry *index;
+} Media;
+
+/* playlist arena: media locations in one string block with an offset array, medias in one array indexed by
+   media id, the media list is navigated by index */
+typedef struct {
+     char   *strings;
+     size_t  length;
+     size_t  size;
+
+     size_t *offsets;
+     int     count;
+     int     max;
+
+     Media  *medias;
+} Playlist;
+
+static Playlist playlist;
+
+/* command line options */
+static int             quiet            = 0;
+static FSSampleFormat  sampleformat     = FSSF_UNKNOWN;
+static const char     *gain             = NULL;
+static int             event_mode       = 0;
+static int             tick             = -1;
+static int             gapless          = 0;
+static int             bench            = 0;
+static const char     *telemetry_prefix = NULL;
+static int             prefetch         = 0;
+static int             buffersize       = 0;
+static int             prebuffer        = 0;
+static int             autotune         = 0;
+static int             meter            = 0;
+static int             analyze          = 0;
+static const char     *gain_cache_file  = NULL;
+static int             mix              = 0;
+static int             depth_bench      = 0;
+static int             start            = 0;
+static const char     *index_file       = NULL;
+static int             seek_bench       = 0;
+static const char     *control_path     = NULL;
+static int             crossfade        = 0;
+static int             time_stretch     = 0;
+static int             stretch_bench    = 0;
+static const char     *dump_file        = NULL;
+static int             dump_only        = 0;
+static const char     *dump_io          = NULL;
+static int             accounting       = 0;
+static int             realtime         = 0;
+static int             stress           = 0;
+static int             shuffle          = 0;
+static const char     *shuffle_seed     = NULL;
+static const char     *cache_dir        = NULL;
+static int             cache_size       = 256;
+
+/* decoding to a buffer through the pipeline is needed by gapless playback and the level meter */
+static int             use_pipeline     = 0;
+
+/* control socket: one client at a time, one command per line */
+#define CONTROL_SEEK    0x100
+#define CONTROL_VOLUME  0x101
+#define CONTROL_PITCH   0x102
+#define CONTROL_STATUS  0x103
+
+typedef struct {
+     int        listen_fd;
+     int        client_fd;
+     char       buf[256];
+     int        len;
+
+     long long  received;   /* time the pending commands were read */
+     int        commands;
+     long long  latency_sum;
+     long long  latency_max;
+} Control;
+
+static Control control = { -1, -1 };
+
+/* crossfade: the ending track keeps its stream while the next one starts on a second stream, both tracks are
+   decoded into a buffer and written to their streams by a fader applying the gain ramps by frame count */
+#define CROSSFADE_POLL  5   /* underrun check interval in ms */
+
+typedef struct {
+     IFusionSoundBuffer        *buffer;
+     IFusionSoundStream        *stream;
+     FSBufferDescription        src;
+     FSSampleFormat             format;       /* of the stream */
+     float                     *in;
+     void                      *pcm;
+
+     DirectMutex                lock;
+     DirectWaitQueue            cond;
+     long long                  frames;       /* written to the stream */
+     long long                  fade_start;   /* first frame of the ramp, -1 without a ramp */
+     long long                  fade_length;
+     int                        fade_out;     /* ramp down instead of up */
+     int                        request;      /* ramp to start with the next block, 1 up, 2 down */
+     int                        done;         /* the ramp down has ended, nothing more is written */
+} Fader;
+
+static Fader *track_fader = NULL;   /* of the current track */
+
+typedef struct {
+     IFusionSoundMusicProvider *provider;
+     IFusionSoundStream        *stream;
+     IFusionSoundPlayback      *playback;
+     Fader                     *fader;
+
+     IFusionSoundStream        *in_stream;
+
+     DirectThread              *thread;
+
+     /* statistics of all crossfades */
+     int                        count;
+     long long                  time;
+     long long                  cpu;
+     int                        underruns_out;
+     int                        underruns_in;
+} Crossfade;
+
+static Crossfade xfade;
+
+/* capture of decoded audio: the decoding thread fills one buffer while a writer thread writes the other */
+#define DUMP_BUFFER  (1 << 20)
+#define DUMP_ALIGN   4096
+
+typedef struct {
+     int             fd;
+     int             direct;
+     int             fadvise;
+     int             raw;
+
+     FSSampleFormat  format;
+     int             channels;
+     int             samplerate;
+     int             mismatch;
+
+     u8             *buffers[2];
+     int             fill[2];
+     int             current;
+
+     DirectThread   *thread;
+     DirectMutex     lock;
+     DirectWaitQueue cond;
+     int             pending;   /* buffer handed to the writer, -1 for none */
+     int             stop;
+
+     long long       bytes;
+     long long       offset;
+     long long       start;
+     long long       write_time;
+     int             stalls;
+     long long       stall_total;
+     long long       stall_max;
+} Dump;
+
+static Dump dump = { .fd = -1 };
+
+/* realtime mode: locked memory, SCHED_FIFO decoding thread, wakeup latency probe */
+#define REALTIME_PRIORITY  80
+#define REALTIME_PERIOD    1000          /* latency probe period in us */
+#define REALTIME_STACK     (64 * 1024)   /* stack prefaulted in realtime threads */
+#define REALTIME_HEAP      (8 << 20)     /* heap prefaulted at startup */
+#define STRESS_MEMORY      (64 << 20)    /* memory touched per stress iteration */
+
+typedef struct {
+     int           locked;
+     int           failed;
+     int           feeders;      /* threads switched to SCHED_FIFO by the buffer callback */
+
+     DirectThread *probe;
+     DirectMutex   lock;         /* held by the probe while it queries the stream */
+     volatile int  stop;
+     int           active;       /* a track is playing, the stream is not released while set */
+
+     long long     wakeups;
+     long long     latency_sum;
+     long long     latency_max;
+     long long     late;
+     int           underruns;
+
+     pid_t        *stress_pids;
+     int           stress_count;
+} Realtime;
+
+static Realtime rt;
+
+static __thread int realtime_thread = 0;
+
+/* status loop statistics */
+static long long wakeups    = 0;
+static long long loop_time  = 0;
+static long long loop_cpu   = 0;
+static long long total_cpu  = 0;
+
+/* track switch latency, from the end of a track to the start of the next one */
+static int       switches     = 0;
+static long long switch_total = 0;
+static long long switch_max   = 0;
+static long long switch_start = 0;
+
+/* decoded audio pipeline: the music provider decodes into a buffer in the native format of the track,
+   the buffer callback converts and resamples the decoded frames and writes them to the output stream */
+typedef struct {
+     IFusionSoundBuffer  *buffer;
+     FSBufferDescription  src;
+     FSStreamDescription  dst;
+
+     /* linear resampler state */
+     double               step;
+     double               phase;
+     float               *prev;
+     int                  primed;
+
+     /* scratch buffers */
+     float               *in;
+     float               *out;
+     void                *pcm;
+     int                  in_samples;
+     int                  out_samples;
+
+     /* inter-track gap measurement */
+     long long            end_time;
+     int                  end_filled;
+     int                  transitions;
+     long long            gap_total;
+     int                  gap_max;
+} Pipeline;
+
+static Pipeline pipeline;
+
+/* pitch-preserving time-stretch (WSOLA): grains of the input are overlap-added at a fixed output hop, each one
+   taken from around its nominal input position where it best continues the previous grain */
+#define STRETCH_WINDOW  20     /* grain length in ms, grains overlap by half */
+#define STRETCH_SEARCH  6      /* similarity search range in ms */
+#define STRETCH_COARSE  4      /* step of the coarse search in frames */
+#define STRETCH_MIN     0.5f
+#define STRETCH_MAX     2.0f
+
+typedef struct {
+     int         channels;
+     int         samplerate;
+     int         half;         /* output hop and overlap in frames */
+     int         search;       /* search range in frames */
+     float       speed;
+
+     /* requested by the main thread, applied by the decoding thread before the next block */
+     DirectMutex lock;
+     float       request_speed;
+     int         request_reset;
+
+     /* windows and overlap, interleaved */
+     float      *win_in;
+     float      *win_out;
+     float      *olap;
+
+     /* input not consumed yet */
+     float      *fifo;
+     int         fifo_frames;
+     int         fifo_max;
+
+     double      next_pos;     /* nominal input position of the next grain */
+     int         prev_pos;     /* input position of the previous grain, may be before the fifo start */
+     int         primed;       /* a previous grain exists */
+
+     float      *out;
+     int         out_max;
+
+     long long   time;
+     long long   frames;
+} Stretch;
+
+static Stretch stretch = { .speed = 1, .request_speed = 1 };
+
+/* level meter of the decoded audio */
+#define METER_CHANNELS 8
+
+typedef struct {
+     DirectMutex lock;
+
+     int         channels;
+     float       peak[METER_CHANNELS];
+     double      sum[METER_CHANNELS];
+     long long   frames;
+
+     /* overhead */
+     long long   time;
+     long long   total_frames;
+     int         samplerate;
+} LevelMeter;
+
+static LevelMeter level_meter;
+
+/* decode benchmark statistics per codec */
+typedef struct {
+     char      encoding[sizeof(((FSTrackDescription*) NULL)->encoding)];
+     int       tracks;
+     double    audio;
+     long long wall;
+     long long cpu;
+     long      peak_rss;
+} CodecStats;
+
+static CodecStats *codec_stats = NULL;
+static int         codec_count = 0;
+static int         codec_max   = 0;
+
+/* ring buffer telemetry of the current track */
+#define TELEMETRY_INTERVAL  10   /* sampling interval in ms */
+#define TELEMETRY_LOW       10   /* near-underrun threshold in percent of the ring buffer */
+#define TELEMETRY_BINS      20
+
+typedef struct {
+     DirectThread              *thread;
+     DirectMutex                lock;
+     DirectWaitQueue            cond;
+     int                        stop;
+
+     IFusionSoundMusicProvider *provider;
+     FILE                      *file;
+     long long                  start;
+
+     int                        samples;
+     int                        underruns;
+     int                        near_underruns;
+     int                        min_filled;
+     int                        total;
+     int                        histogram[TELEMETRY_BINS];
+} Telemetry;
+
+static Telemetry telemetry;
+
+/* sampling interval in us, shorter while auto-tuning small buffers */
+static int telemetry_interval = TELEMETRY_INTERVAL * 1000;
+
+/* resource accounting per track, codec and thread */
+#define ACCOUNT_THREADS  64
+
+typedef struct {
+     int       tid;
+     char      name[16];
+     long long ticks;      /* user and system time in clock ticks */
+} ThreadSample;
+
+typedef struct {
+     long long     time;
+     struct rusage usage;
+     long          rss;
+
+     ThreadSample  threads[ACCOUNT_THREADS];
+     int           num_threads;
+} AccountSample;
+
+typedef struct {
+     char      encoding[sizeof(((FSTrackDescription*) NULL)->encoding)];
+     int       tracks;
+     long long wall;
+     long long user;
+     long long system;
+     long      vcsw;
+     long      ivcsw;
+     long      rss_delta;
+     long      rss_max;
+} AccountStats;
+
+typedef struct {
+     char      name[16];
+     long long ticks;
+} ThreadTotal;
+
+static AccountSample  account_begin_sample;
+static AccountStats  *account_stats = NULL;
+static int            account_count = 0;
+static int            account_max   = 0;
+static ThreadTotal   *thread_totals = NULL;
+static int            thread_count  = 0;
+static int            thread_max    = 0;
+
+/* sample format conversion benchmark */
+#define DEPTH_REFERENCE  60   /* seconds of native decoded audio kept for the null test */
+
+typedef struct {
+     IFusionSoundBuffer  *buffer;
+     FSBufferDescription  desc;
+     float               *pcm;
+     float               *reference;
+     long long            reference_frames;
+     int                  fill_reference;
+     long long            frames;
+     long long            bytes;
+     double               error_sum;
+     float                error_max;
+     long long            compared;
+} DepthRun;
+
+typedef struct {
+     FSSampleFormat       format;
+     int                  tracks;
+     double               audio;
+     long long            wall;
+     long long            cpu;
+     long long            bytes;
+     double               error_sum;
+     long long            compared;
+     float                error_max;
+} DepthStats;
+
+static DepthStats depth_stats[] = {
+     { FSSF_UNKNOWN }, { FSSF_U8 }, { FSSF_S16 }, { FSSF_S24 }, { FSSF_S32 }
+};
+
+/* seek latency and accuracy benchmark */
+typedef struct {
+     IFusionSoundBuffer  *buffer;
+     DirectMutex          lock;
+     DirectWaitQueue      cond;
+     int                  pending;
+     long long            seek_time;
+     long long            latency;
+     long long            frames;
+} SeekRun;
+
+typedef struct {
+     char                 encoding[32];
+     double              *latency;   /* ms */
+     double              *error;     /* ms */
+     int                  count;
+     int                  max;
+} SeekStats;
+
+static SeekStats *seek_stats       = NULL;
+static int        seek_codec_count = 0;
+static int        seek_codec_max   = 0;
+
+/* multi-stream mixer stress test */
+#define MIX_WINDOW  3000   /* playback time in ms for each number of streams */
+
+typedef struct {
+     IFusionSoundMusicProvider *provider;
+     IFusionSoundStream        *stream;
+     int                        underruns;
+     int                        in_underrun;
+     int                        was_filled;
+} MixVoice;
+
+/* media opened and enumerated ahead of time */
+typedef enum {
+     PREFETCH_WANTED,
+     PREFETCH_OPENING,
+     PREFETCH_READY,
+     PREFETCH_FAILED
+} PrefetchState;
+
+typedef struct {
+     DirectLink                 link;
+
+     Media                     *media;
+     PrefetchState              state;
+     int                        discard;
+
+     IFusionSoundMusicProvider *provider;
+     TrackList                  tracks;
+     long long                  time;
+} PrefetchEntry;
+
+typedef struct {
+     DirectThread    *thread;
+     DirectMutex      lock;
+     DirectWaitQueue  cond;
+     int              stop;
+
+     DirectLink      *entries;
+
+     /* switch latency statistics */
+     int              hits;
+     long long        hit_latency;
+     long long        saved;
+     int              misses;
+     long long        miss_latency;
+} Prefetcher;
+
+static Prefetcher prefetcher;
+
+/* shuffle: seeded permutation of all (media, track) pairs */
+typedef struct {
+     Media     *media;
+     FSTrackID  id;
+} ShuffleEntry;
+
+typedef struct {
+     ShuffleEntry *entries;
+     ShuffleEntry *next;        /* permutation of the next pass, generated ahead of time for prefetching */
+     int           count;
+     int           pos;
+
+     u64           seed;
+     u64           state;
+     int           passes;
+     long long     enum_time;
+     int           probed;      /* medias opened for enumeration, not found in the index */
+} Shuffle;
+
+static Shuffle shuffle_order;
+
+/* PCM decode cache: tracks decoded in the background to files, played from a memory mapping */
+#define CACHE_MAGIC  0x4d435046   /* 'FPCM' */
+
+/* the header is followed by the location of the media, zero terminated and padded to 8 bytes, and the frames */
+typedef struct {
+     u32  magic;
+     u32  track;
+     s64  size;           /* size and modification time of the media */
+     s64  mtime;
+     s32  sampleformat;
+     s32  channels;
+     s32  samplerate;
+     s32  mrl_size;       /* padded size of the location */
+     s64  frames;
+     s64  decode_cpu;     /* decoding cost in us */
+} CacheHeader;
+
+#define CACHE_MRL_SIZE(mrl)  ((strlen( mrl ) + 8) & ~7)
+
+typedef struct {
+     DirectLink  link;
+
+     char       *mrl;
+     FSTrackID   track;
+} CacheJob;
+
+typedef struct {
+     char       name[64];
+     long long  size;
+     long long  mtime;
+} CacheFile;
+
+typedef struct {
+     DirectThread    *thread;
+     DirectMutex      lock;
+     DirectWaitQueue  cond;
+     int              stop;
+
+     DirectLink      *jobs;
+     long long        limit;
+     int              generation;   /* incremented with each completed track */
+
+     /* statistics */
+     int              hits;
+     int              decoded;
+     double           decoded_audio;
+     long long        decoded_cpu;
+     int              evicted;
+     double           served_audio;
+     long long        served_cpu;   /* copying from the mapping */
+     long long        saved_cpu;    /* decoding cost of the served audio */
+} Cache;
+
+static Cache cache;
+
+/* music provider playing a cached track */
+typedef struct {
+     void                         *map;
+     size_t                        map_size;
+     const CacheHeader            *header;
+     const u8                     *data;
+     int                           frame_size;
+
+     DirectThread                 *thread;
+     DirectMutex                   lock;
+     DirectWaitQueue               cond;
+     int                           stop;
+
+     FSMusicProviderStatus         status;
+     FSMusicProviderPlaybackFlags  flags;
+     long long                     pos;
+     int                           seeked;
+
+     IFusionSoundBuffer           *buffer;
+     FMBufferCallback              callback;
+     void                         *ctx;
+
+     long long                     served;
+     long long                     cpu;
+} CachePlayer;
+
+/* loudness analysis (EBU R128 integrated loudness, ReplayGain 2.0 reference level) */
+#define LOUDNESS_REFERENCE  -18.0   /* LUFS */
+
+typedef struct {
+     IFusionSoundBuffer *buffer;
+     FSBufferDescription desc;
+     float              *pcm;
+
+     /* K-weighting filter: high shelf and high pass biquads */
+     double              b[2][3];
+     double              a[2][3];
+     double              z[METER_CHANNELS][2][2];
+
+     /* 100 ms sub-blocks, 400 ms gating blocks with 75% overlap */
+     int                 sub_length;
+     int                 sub_frames;
+     double              sub_sum[METER_CHANNELS];
+     double              sub_energy[4];
+     int                 sub_count;
+
+     double             *blocks;
+     int                 num_blocks;
+     int                 max_blocks;
+
+     long long           frames;
+} Loudness;
+
+/* analysis result of a track */
+typedef struct {
+     DirectLink          link;
+
+     Media              *media;
+     FSTrackID           id;
+     char                album[sizeof(((FSTrackDescription*) NULL)->album)];
+     double             *blocks;
+     int                 num_blocks;
+     double              seconds;
+     float               track_gain;
+     float               album_gain;
+     int                 album_done;
+} GainResult;
+
+/* persistent gain cache entry, keyed by path, size, modification time and track */
+typedef struct {
+     char               *path;
+     long long           size;
+     long long           mtime;
+     FSTrackID           id;
+     float               track_gain;
+     float               album_gain;
+} GainEntry;
+
+static GainEntry *gain_entries     = NULL;
+static int        gain_entry_count = 0;
+static int        gain_entry_max   = 0;
+
+/******************************************************************************/
+
+static DirectResult track_list_add( TrackList *list, FSTrackID track_id )
+{
+     if (list->count == list->max) {
+          int        max = list->max ? list->max * 2 : 8;
+          FSTrackID *ids = D_REALLOC( list->ids, max * sizeof(FSTrackID) );
+
+          if (!ids)
+               return D_OOM();
+
+          list->ids = ids;
+          list->max = max;
+     }
+
+     list->ids[list->count++] = track_id;
+
+     return DR_OK;
+}
+
+static void track_list_clear( TrackList *list )
+{
+     if (list->ids)
+          D_FREE( list->ids );
+
+     memset( list, 0, sizeof(TrackList) );
+}
+
+static DirectEnumerationResult track_cb( FSTrackID track_id, FSTrackDescription desc, void *ctx )
+{
+     Media *media = ctx;
+
+     if (track_list_add( &media->tracks, track_id ))
+          return DENUM_CANCEL;
+
+     return DENUM_OK;
+}
+
+/******************************************************************************/
+
+static DirectResult playlist_add( const char *dir, size_t dir_length, const char *mrl, size_t length )
+{
+     size_t needed = dir_length + 1 + length + 1;
+
+     if (playlist.length + needed > playlist.size) {
+          size_t  size    = MAX( playlist.size * 2, playlist.length + needed + 4096 );
+          char   *strings = D_REALLOC( playlist.strings, size );
+
+          if (!strings)
+               return D_OOM();
+
+          playlist.strings = strings;
+          playlist.size    = size;
+     }
+
+     if (playlist.count == playlist.max) {
+          int     max     = playlist.max ? playlist.max * 2 : 256;
+          size_t *offsets = D_REALLOC( playlist.offsets, max * sizeof(size_t) );
+
+          if (!offsets)
+               return D_OOM();
+
+          playlist.offsets = offsets;
+          playlist.max     = max;
+     }
+
+     playlist.offsets[playlist.count++] = playlist.length;
+
+     /* relative locations are relative to the playlist file */
+     if (dir_length && *mrl != '/' && !strstr( mrl, "://" )) {
+          memcpy( playlist.strings + playlist.length, dir, dir_length );
+          playlist.strings[playlist.length + dir_length] = '/';
+          playlist.length += dir_length + 1;
+     }
+
+     memcpy( playlist.strings + playlist.length, mrl, length );
+     playlist.strings[playlist.length + length] = 0;
+     playlist.length += length + 1;
+
+     return DR_OK;
+}
+
+static int playlist_is_playlist( const char *filename )
+{
+     const char *ext = strrchr( filename, '.' );
+
+     return ext && (!strcasecmp( ext, ".m3u" ) || !strcasecmp( ext, ".m3u8" ) || !strcasecmp( ext, ".pls" ));
+}
+
+/* read an M3U or PLS playlist */
+static DirectResult playlist_load( const char *filename )
+{
+     FILE       *f;
+     char        line[4096];
+     const char *slash      = strrchr( filename, '/' );
+     size_t      dir_length = slash ? slash - filename : 0;
+     int         pls        = !strcasecmp( strrchr( filename, '.' ), ".pls" );
+
+     f = fopen( filename, "r" );
+     if (!f) {
+          fprintf( stderr, "Failed to open playlist '%s'!\n", filename );
+          return DR_FILENOTFOUND;
+     }
+
+     while (fgets( line, sizeof(line), f )) {
+          char   *mrl    = line;
+          size_t  length = strcspn( line, "\r\n" );
+
+          line[length] = 0;
+
+          if (pls) {
+               /* FileN=location */
+               if (strncasecmp( line, "File", 4 ))
+                    continue;
+
+               mrl = strchr( line, '=' );
+               if (!mrl)
+                    continue;
+
+               mrl++;
+               length -= mrl - line;
+          }
+          else if (*line == '#') {
+               continue;
+          }
+
+          if (!length)
+               continue;
+
+          if (playlist_add( filename, dir_length, mrl, length )) {
+               fclose( f );
+               return DR_NOLOCALMEMORY;
+          }
+     }
+
+     fclose( f );
+
+     return DR_OK;
+}
+
+/* build the media array once all locations are known */
+static DirectResult playlist_finish()
+{
+     char   *strings;
+     size_t *offsets;
+     int     i;
+
+     if (!playlist.count)
+          return DR_OK;
+
+     /* trim the string block and the offsets to their final size */
+     strings = D_REALLOC( playlist.strings, playlist.length );
+     if (strings) {
+          playlist.strings = strings;
+          playlist.size    = playlist.length;
+     }
+
+     offsets = D_REALLOC( playlist.offsets, playlist.count * sizeof(size_t) );
+     if (offsets) {
+          playlist.offsets = offsets;
+          playlist.max     = playlist.count;
+     }
+
+     playlist.medias = D_CALLOC( playlist.count, sizeof(Media) );
+     if (!playlist.medias)
+          return D_OOM();
+
+     for (i = 0; i < playlist.count; i++) {
+          Media *media = &playlist.medias[i];
+
+          media->mrl = playlist.strings + playlist.offsets[i];
+          media->id  = i;
+     }
+
+     return DR_OK;
+}
+
+/* media at an index of the media list, NULL outside of it */
+static Media *playlist_media( int index )
+{
+     return (index >= 0 && index < playlist.count) ? &playlist.medias[index] : NULL;
+}
+
+/* memory of the media list, without the track IDs enumerated during playback */
+static size_t playlist_memory()
+{
+     return playlist.size + playlist.max * sizeof(size_t) + playlist.count * sizeof(Media);
+}
+
+static void playlist_free()
+{
+     if (playlist.medias)
+          D_FREE( playlist.medias );
+
+     if (playlist.offsets)
+          D_FREE( playlist.offsets );
+
+     if (playlist.strings)
+          D_FREE( playlist.strings );
+
+     memset( &playlist, 0, sizeof(playlist) );
+}
+
+/******************************************************************************/
+
+/* persistent track and metadata index */
+#define INDEX_MAGIC    0x494d5346   /* "FSMI" */
+#define INDEX_VERSION  2
+
+/*
+ * Tracks are stored as raw IndexTrack structs including FusionSound descriptions, so an index written with another
+ * format version, struct layout or word size is discarded.
+ */
+typedef struct {
+     int           magic;
+     int           version;
+     int           track_size;
+} IndexHeader;
+
+typedef struct {
+     DirectLink   *entries;
+     DirectHash   *hash;
+
+     DirectMutex   lock;
+     IndexEntry  **jobs;
+     int           num_jobs;
+     int           next_job;
+
+     int           reused;
+     int           probed;
+     long long     build_time;
+     long long     probe_time;
+
+     int           hits;
+     long long     saved;
+} Index;
+
+static Index media_index;
+
+static unsigned long index_hash( const char *path )
+{
+     unsigned long hash = 2166136261u;
+
+     while (*path)
+          hash = (hash ^ (u8) *path++) * 16777619u;
+
+     return hash;
+}
+
+static IndexEntry *index_lookup( const char *path )
+{
+     IndexEntry *entry;
+
+     for (entry = direct_hash_lookup( media_index.hash, index_hash( path ) ); entry; entry = entry->next) {
+          if (!strcmp( entry->path, path ))
+               return entry;
+     }
+
+     return NULL;
+}
+
+static IndexEntry *index_add( const char *path )
+{
+     IndexEntry    *entry;
+     unsigned long  key = index_hash( path );
+
+     entry = D_CALLOC( 1, sizeof(IndexEntry) );
+     if (!entry) {
+          D_OOM();
+          return NULL;
+     }
+
+     entry->path = D_STRDUP( path );
+     entry->next = direct_hash_lookup( media_index.hash, key );
+
+     if (entry->next)
+          direct_hash_remove( media_index.hash, key );
+
+     direct_hash_insert( media_index.hash, key, entry );
+
+     direct_list_append( &media_index.entries, &entry->link );
+
+     return entry;
+}
+
+static IndexTrack *index_track( IndexEntry *entry, FSTrackID id )
+{
+     int i;
+
+     for (i = 0; i < entry->num_tracks; i++) {
+          if (entry->tracks[i].id == id)
+               return &entry->tracks[i];
+     }
+
+     return NULL;
+}
+
+static void index_load()
+{
+     FILE        *f;
+     int          length;
+     char         path[4096];
+     IndexHeader  header;
+     IndexEntry  *entry;
+
+     f = fopen( index_file, "rb" );
+     if (!f)
+          return;
+
+     if (fread( &header, sizeof(header), 1, f ) != 1 || header.magic != INDEX_MAGIC ||
+         header.version != INDEX_VERSION || header.track_size != sizeof(IndexTrack)) {
+          if (!quiet)
+               fprintf( stderr, "Discarding index '%s' of another format.\n", index_file );
+
+          fclose( f );
+          return;
+     }
+
+     /* path length, path, size, modification time, probe time, track count and tracks */
+     while (fread( &length, sizeof(int), 1, f ) == 1) {
+          if (length <= 0 || length >= (int) sizeof(path) || fread( path, length, 1, f ) != 1)
+               break;
+
+          path[length] = 0;
+
+          entry = index_add( path );
+          if (!entry)
+               break;
+
+          if (fread( &entry->size, sizeof(long long), 1, f ) != 1 ||
+              fread( &entry->mtime, sizeof(long long), 1, f ) != 1 ||
+              fread( &entry->probe_time, sizeof(long long), 1, f ) != 1 ||
+              fread( &entry->num_tracks, sizeof(int), 1, f ) != 1 || entry->num_tracks < 0)
+               break;
+
+          entry->tracks = D_CALLOC( entry->num_tracks ?: 1, sizeof(IndexTrack) );
+          if (!entry->tracks)
+               break;
+
+          entry->max_tracks = entry->num_tracks;
+
+          if (fread( entry->tracks, sizeof(IndexTrack), entry->num_tracks, f ) != (size_t) entry->num_tracks)
+               break;
+
+          entry->valid = 1;
+     }
+
+     fclose( f );
+}
+
+static void index_save()
+{
+     FILE        *f;
+     IndexHeader  header = { INDEX_MAGIC, INDEX_VERSION, sizeof(IndexTrack) };
+     IndexEntry  *entry;
+
+     f = fopen( index_file, "wb" );
+     if (!f) {
+          fprintf( stderr, "Failed to write index '%s'!\n", index_file );
+          return;
+     }
+
+     fwrite( &header, sizeof(header), 1, f );
+
+     direct_list_foreach (entry, media_index.entries) {
+          int length = strlen( entry->path );
+
+          if (!entry->valid)
+               continue;
+
+          fwrite( &length, sizeof(int), 1, f );
+          fwrite( entry->path, length, 1, f );
+          fwrite( &entry->size, sizeof(long long), 1, f );
+          fwrite( &entry->mtime, sizeof(long long), 1, f );
+          fwrite( &entry->probe_time, sizeof(long long), 1, f );
+          fwrite( &entry->num_tracks, sizeof(int), 1, f );
+          fwrite( entry->tracks, sizeof(IndexTrack), entry->num_tracks, f );
+     }
+
+     fclose( f );
+}
+
+static DirectEnumerationResult index_track_cb( FSTrackID track_id, FSTrackDescription desc, void *ctx )
+{
+     IndexEntry *entry = ctx;
+
+     if (entry->num_tracks == entry->max_tracks) {
+          int         max    = entry->max_tracks ? entry->max_tracks * 2 : 4;
+          IndexTrack *tracks = D_REALLOC( entry->tracks, max * sizeof(IndexTrack) );
+
+          if (!tracks) {
+               D_OOM();
+               return DENUM_CANCEL;
+          }
+
+          entry->tracks     = tracks;
+          entry->max_tracks = max;
+     }
+
+     memset( &entry->tracks[entry->num_tracks], 0, sizeof(IndexTrack) );
+
+     entry->tracks[entry->num_tracks].id   = track_id;
+     entry->tracks[entry->num_tracks].desc = desc;
+     entry->num_tracks++;
+
+     return DENUM_OK;
+}
+
+static void index_probe( IndexEntry *entry )
+{
+     IFusionSoundMusicProvider *provider;
+     long long                  t0;
+     int                        i;
+
+     entry->num_tracks = 0;
+
+     if (sound->CreateMusicProvider( sound, entry->path, &provider ))
+          return;
+
+     /* the part of opening a media that the index saves */
+     t0 = direct_clock_get_micros();
+
+     if (provider->EnumTracks( provider, index_track_cb, entry ) == DR_OK) {
+          for (i = 0; i < entry->num_tracks; i++) {
+               IndexTrack *track = &entry->tracks[i];
+
+               if (provider->SelectTrack( provider, track->id ))
+                    continue;
+
+               provider->GetLength( provider, &track->length );
+               provider->GetStreamDescription( provider, &track->format );
+          }
+
+          entry->valid = 1;
+     }
+
+     entry->probe_time = direct_clock_get_micros() - t0;
+
+     provider->Release( provider );
+}
+
+static void *index_thread( DirectThread *thread, void *arg )
+{
+     while (1) {
+          IndexEntry *entry = NULL;
+
+          direct_mutex_lock( &media_index.lock );
+
+          if (media_index.next_job < media_index.num_jobs)
+               entry = media_index.jobs[media_index.next_job++];
+
+          direct_mutex_unlock( &media_index.lock );
+
+          if (!entry)
+               break;
+
+          index_probe( entry );
+     }
+
+     return NULL;
+}
+
+/* validate the index against the media list and probe new or modified medias in parallel */
+static void index_build()
+{
+     Media         *media;
+     DirectThread **threads;
+     int            num_threads = sysconf( _SC_NPROCESSORS_ONLN );
+     long long      t0          = direct_clock_get_micros();
+     int            i;
+
+     if (direct_hash_create( 1021, &media_index.hash ))
+          return;
+
+     index_load();
+
+     media_index.jobs = D_CALLOC( playlist.count ?: 1, sizeof(IndexEntry*) );
+     if (!media_index.jobs) {
+          D_OOM();
+          return;
+     }
+
+     for (media = playlist.medias; media < playlist.medias + playlist.count; media++) {
+          IndexEntry  *entry;
+          struct stat  st;
+
+          /* only local files can be validated */
+          if (stat( media->mrl, &st ))
+               continue;
+
+          entry = index_lookup( media->mrl ) ?: index_add( media->mrl );
+          if (!entry)
+               continue;
+
+          if (entry->size != st.st_size || entry->mtime != st.st_mtime)
+               entry->valid = 0;
+
+          if (!entry->valid && !entry->queued) {
+               entry->size   = st.st_size;
+               entry->mtime  = st.st_mtime;
+               entry->queued = 1;
+
+               media_index.jobs[media_index.num_jobs++] = entry;
+          }
+          else if (entry->valid && !entry->queued) {
+               media_index.reused++;
+          }
+
+          media->index = entry;
+     }
+
+     if (media_index.num_jobs) {
+          num_threads = CLAMP( num_threads, 1, media_index.num_jobs );
+
+          threads = alloca( num_threads * sizeof(DirectThread*) );
+
+          direct_mutex_init( &media_index.lock );
+
+          for (i = 0; i < num_threads; i++)
+               threads[i] = direct_thread_create( DTT_DEFAULT, index_thread, NULL, "Index" );
+
+          for (i = 0; i < num_threads; i++) {
+               direct_thread_join( threads[i] );
+               direct_thread_destroy( threads[i] );
+          }
+
+          direct_mutex_deinit( &media_index.lock );
+
+          for (i = 0; i < media_index.num_jobs; i++) {
+               media_index.probed++;
+               media_index.probe_time += media_index.jobs[i]->probe_time;
+          }
+
+          index_save();
+     }
+
+     D_FREE( media_index.jobs );
+     media_index.jobs = NULL;
+
+     media_index.build_time = direct_clock_get_micros() - t0;
+
+     fprintf( stderr, "Index: %d medias reused, %d probed with %d threads (%lld ms of probing) in %lld.%03lld ms\n",
+              media_index.reused, media_index.probed, media_index.num_jobs ? num_threads : 0,
+              media_index.probe_time / 1000, media_index.build_time / 1000, media_index.build_time % 1000 );
+}
+
+/* fill the track list of a media from the index instead of enumerating the tracks */
+static DirectResult index_fill_tracks( Media *media, TrackList *ret_tracks )
+{
+     IndexEntry *entry = media->index;
+     int         i;
+
+     if (!entry || !entry->valid)
+          return DR_FAILURE;
+
+     for (i = 0; i < entry->num_tracks; i++) {
+          if (track_list_add( ret_tracks, entry->tracks[i].id )) {
+               track_list_clear( ret_tracks );
+               return DR_NOLOCALMEMORY;
+          }
+     }
+
+     return DR_OK;
+}
+
+static void index_free()
+{
+     IndexEntry *entry, *entry_next;
+
+     direct_list_foreach_safe (entry, entry_next, media_index.entries) {
+          if (entry->tracks)
+               D_FREE( entry->tracks );
+          D_FREE( entry->path );
+          D_FREE( entry );
+     }
+
+     if (media_index.hash)
+          direct_hash_destroy( media_index.hash );
+
+     memset( &media_index, 0, sizeof(media_index) );
+}
+
+/******************************************************************************/
+
+static void pcm_to_float( const void *src, FSSampleFormat format, int samples, float *dst )
+{
+     int i;
+
+     switch (format) {
+          case FSSF_U8:
+               for (i = 0; i < samples; i++)
+                    dst[i] = (((const u8*) src)[i] - 128) / 128.0f;
+               break;
+          case FSSF_S16:
+               for (i = 0; i < samples; i++)
+                    dst[i] = ((const s16*) src)[i] / 32768.0f;
+               break;
+          case FSSF_S24:
+               for (i = 0; i < samples; i++) {
+                    const u8 *p = (const u8*) src + i * 3;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                    int       v = ((s8) p[0] << 16) | (p[1] << 8) | p[2];
+#else
+                    int       v = ((s8) p[2] << 16) | (p[1] << 8) | p[0];
+#endif
+                    dst[i] = v / 8388608.0f;
+               }
+               break;
+          case FSSF_S32:
+               for (i = 0; i < samples; i++)
+                    dst[i] = ((const s32*) src)[i] / 2147483648.0f;
+               break;
+          case FSSF_FLOAT:
+               memcpy( dst, src, samples * sizeof(float) );
+               break;
+          default:
+               memset( dst, 0, samples * sizeof(float) );
+               break;
+     }
+}
+
+static void float_to_pcm( const float *src, int samples, FSSampleFormat format, void *dst )
+{
+     int i;
+
+     for (i = 0; i < samples; i++) {
+          float v = CLAMP( src[i], -1.0f, 1.0f );
+
+          switch (format) {
+               case FSSF_U8:
+                    ((u8*) dst)[i] = CLAMP( (int) (v * 128.0f) + 128, 0, 255 );
+                    break;
+               case FSSF_S16:
+                    ((s16*) dst)[i] = CLAMP( (int) (v * 32768.0f), -32768, 32767 );
+                    break;
+               case FSSF_S24: {
+                    int  s = CLAMP( (int) (v * 8388608.0f), -8388608, 8388607 );
+                    u8  *p = (u8*) dst + i * 3;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                    p[0] = s >> 16;
+                    p[1] = s >> 8;
+                    p[2] = s;
+#else
+                    p[0] = s;
+                    p[1] = s >> 8;
+                    p[2] = s >> 16;
+#endif
+                    break;
+               }
+               case FSSF_S32:
+                    ((s32*) dst)[i] = v >= 1.0f ? 2147483647 : (s32) (v * 2147483648.0);
+                    break;
+               case FSSF_FLOAT:
+                    ((float*) dst)[i] = v;
+                    break;
+               default:
+                    break;
+          }
+     }
+}
+
+/*
+ * Time-stretch kernels on interleaved samples, using unaligned vectors of 8 samples.
+ */
+
+typedef float v8sf_u __attribute__((vector_size(32), aligned(4)));
+
+/* correlation of a candidate grain with the template, normalized by the candidate energy so that louder candidates
+   are not preferred */
+static float stretch_similarity( const float *tmpl, const float *cand, int n )
+{
+     v8sf_u sum    = { 0 };
+     v8sf_u energy = { 0 };
+     float  corr, e;
+     int    i;
+
+     for (i = 0; i + 8 <= n; i += 8) {
+          v8sf_u c = *(const v8sf_u*) (cand + i);
+
+          sum    += *(const v8sf_u*) (tmpl + i) * c;
+          energy += c * c;
+     }
+
+     corr = sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] + sum[7];
+     e    = energy[0] + energy[1] + energy[2] + energy[3] + energy[4] + energy[5] + energy[6] + energy[7];
+
+     for (; i < n; i++) {
+          corr += tmpl[i] * cand[i];
+          e    += cand[i] * cand[i];
+     }
+
+     return corr / sqrtf( e + 1e-9f );
+}
+
+/* fade in the first half of the grain against the overlap, keep the faded out second half as the next overlap */
+static void stretch_overlap_add( float *dst, float *olap, const float *win_in, const float *win_out, const float *src,
+                                 int n )
+{
+     int i;
+
+     for (i = 0; i + 8 <= n; i += 8) {
+          v8sf_u o = *(v8sf_u*) (olap + i);
+
+          *(v8sf_u*) (dst + i)  = o + *(const v8sf_u*) (win_in + i) * *(const v8sf_u*) (src + i);
+          *(v8sf_u*) (olap + i) = *(const v8sf_u*) (win_out + i) * *(const v8sf_u*) (src + n + i);
+     }
+
+     for (; i < n; i++) {
+          dst[i]  = olap[i] + win_in[i] * src[i];
+          olap[i] = win_out[i] * src[n + i];
+     }
+}
+
+static void stretch_free()
+{
+     if (stretch.win_in)  D_FREE( stretch.win_in );
+     if (stretch.win_out) D_FREE( stretch.win_out );
+     if (stretch.olap)    D_FREE( stretch.olap );
+     if (stretch.fifo)    D_FREE( stretch.fifo );
+     if (stretch.out)     D_FREE( stretch.out );
+
+     stretch.win_in = stretch.win_out = stretch.olap = stretch.fifo = stretch.out = NULL;
+
+     stretch.channels = stretch.fifo_max = stretch.out_max = 0;
+}
+
+static void stretch_reset()
+{
+     stretch.fifo_frames = 0;
+     stretch.next_pos    = 0;
+     stretch.prev_pos    = 0;
+     stretch.primed      = 0;
+
+     if (stretch.olap)
+          memset( stretch.olap, 0, stretch.half * stretch.channels * sizeof(float) );
+}
+
+static void stretch_set_speed( float speed )
+{
+     direct_mutex_lock( &stretch.lock );
+     stretch.request_speed = speed;
+     direct_mutex_unlock( &stretch.lock );
+}
+
+/* drop the input and overlap of the previous position, e.g. after a seek */
+static void stretch_request_reset()
+{
+     direct_mutex_lock( &stretch.lock );
+     stretch.request_reset = 1;
+     direct_mutex_unlock( &stretch.lock );
+}
+
+/* the state is kept across tracks of the same format */
+static DirectResult stretch_setup( int channels, int samplerate, int out_max )
+{
+     int i, c;
+
+     if (stretch.channels == channels && stretch.samplerate == samplerate && stretch.out_max >= out_max)
+          return DR_OK;
+
+     stretch_free();
+
+     stretch.channels   = channels;
+     stretch.samplerate = samplerate;
+     stretch.half       = samplerate * STRETCH_WINDOW / 2000;
+     stretch.search     = samplerate * STRETCH_SEARCH / 1000;
+     stretch.out_max    = out_max;
+
+     stretch.win_in  = D_MALLOC( stretch.half * channels * sizeof(float) );
+     stretch.win_out = D_MALLOC( stretch.half * channels * sizeof(float) );
+     stretch.olap    = D_MALLOC( stretch.half * channels * sizeof(float) );
+     stretch.out     = D_MALLOC( out_max * channels * sizeof(float) );
+
+     if (!stretch.win_in || !stretch.win_out || !stretch.olap || !stretch.out) {
+          stretch_free();
+          return D_OOM();
+     }
+
+     /* complementary halves of a Hann window */
+     for (i = 0; i < stretch.half; i++) {
+          float w = sin( M_PI / 2 * (i + 0.5) / stretch.half );
+
+          for (c = 0; c < channels; c++) {
+               stretch.win_in[i * channels + c]  = w * w;
+               stretch.win_out[i * channels + c] = 1 - w * w;
+          }
+     }
+
+     stretch_reset();
+
+     return DR_OK;
+}
+
+/* stretch frames by 1 / speed, returns the number of output frames in stretch.out */
+static int stretch_process( const float *in, int frames )
+{
+     int ch  = stretch.channels;
+     int len = stretch.half * ch;
+     int n   = 0;
+
+     direct_mutex_lock( &stretch.lock );
+
+     stretch.speed = stretch.request_speed;
+
+     if (stretch.request_reset) {
+          stretch.request_reset = 0;
+          stretch_reset();
+     }
+
+     direct_mutex_unlock( &stretch.lock );
+
+     if (stretch.fifo_frames + frames > stretch.fifo_max) {
+          int    max  = (stretch.fifo_frames + frames) * 2;
+          float *fifo = D_REALLOC( stretch.fifo, max * ch * sizeof(float) );
+
+          if (!fifo) {
+               D_OOM();
+               return 0;
+          }
+
+          stretch.fifo     = fifo;
+          stretch.fifo_max = max;
+     }
+
+     memcpy( stretch.fifo + stretch.fifo_frames * ch, in, frames * ch * sizeof(float) );
+     stretch.fifo_frames += frames;
+
+     while (n + stretch.half <= stretch.out_max) {
+          int pos  = stretch.next_pos;
+          int best = pos;
+          int drop;
+
+          /* at normal speed the natural continuation is taken, so the output equals the input */
+          if (stretch.primed && stretch.speed == 1.0f) {
+               best = stretch.prev_pos + stretch.half;
+
+               if (best + 2 * stretch.half > stretch.fifo_frames)
+                    break;
+          }
+          else if (stretch.primed) {
+               const float *tmpl = stretch.fifo + (stretch.prev_pos + stretch.half) * ch;
+               int          lo   = MAX( pos - stretch.search, 0 );
+               int          hi   = pos + stretch.search;
+               int          mid;
+               float        max  = -INFINITY;
+               int          d;
+
+               if (MAX( hi, stretch.prev_pos ) + 2 * stretch.half > stretch.fifo_frames)
+                    break;
+
+               /* find the grain most similar to the natural continuation of the previous one, coarse then fine */
+               for (d = lo; d <= hi; d += STRETCH_COARSE) {
+                    float corr = stretch_similarity( tmpl, stretch.fifo + d * ch, len );
+
+                    if (corr > max) {
+                         max  = corr;
+                         best = d;
+                    }
+               }
+
+               mid = best;
+
+               for (d = MAX( mid - STRETCH_COARSE + 1, lo ); d <= MIN( mid + STRETCH_COARSE - 1, hi ); d++) {
+                    float corr = d != mid ? stretch_similarity( tmpl, stretch.fifo + d * ch, len ) : max;
+
+                    if (corr > max) {
+                         max  = corr;
+                         best = d;
+                    }
+               }
+          }
+          else if (pos + 2 * stretch.half > stretch.fifo_frames) {
+               break;
+          }
+
+          stretch_overlap_add( stretch.out + n * ch, stretch.olap, stretch.win_in, stretch.win_out,
+                               stretch.fifo + best * ch, len );
+
+          n += stretch.half;
+
+          stretch.prev_pos  = best;
+          stretch.next_pos += stretch.half * stretch.speed;
+          stretch.primed    = 1;
+
+          /* drop input that no search or template can reach anymore */
+          drop = MIN( (int) stretch.next_pos - stretch.search, stretch.prev_pos + stretch.half );
+          if (drop > 0) {
+               memmove( stretch.fifo, stretch.fifo + drop * ch, (stretch.fifo_frames - drop) * ch * sizeof(float) );
+
+               stretch.fifo_frames -= drop;
+               stretch.next_pos    -= drop;
+               stretch.prev_pos    -= drop;
+          }
+     }
+
+     return n;
+}
+
+/* CPU cost of the time-stretch on a synthetic stereo signal over the speed range */
+static void run_stretch_bench()
+{
+     static const float speeds[] = { 0.5f, 0.75f, 1.0f, 1.25f, 1.5f, 2.0f };
+
+     const int    channels   = 2;
+     const int    samplerate = 48000;
+     const int    block      = 1024;
+     const int    seconds    = 10;
+     float       *in;
+     unsigned int i;
+     int          j;
+
+     in = D_MALLOC( samplerate * seconds * channels * sizeof(float) );
+     if (!in) {
+          D_OOM();
+          return;
+     }
+
+     for (j = 0; j < samplerate * seconds; j++) {
+          double t = (double) j / samplerate;
+
+          in[j * channels]     = 0.3 * sin( 2 * M_PI * 220 * t ) + 0.2 * sin( 2 * M_PI * 1250 * t );
+          in[j * channels + 1] = 0.3 * sin( 2 * M_PI * 330 * t ) + 0.2 * sin( 2 * M_PI * 2750 * t );
+     }
+
+     if (stretch_setup( channels, samplerate, block / STRETCH_MIN + samplerate * STRETCH_WINDOW / 2000 )) {
+          D_FREE( in );
+          return;
+     }
+
+     printf( "%-8s %12s %20s %18s\n", "Speed", "Output s", "CPU us/s/channel", "Core %/channel" );
+
+     for (i = 0; i < D_ARRAY_SIZE(speeds); i++) {
+          long long cpu0, cpu;
+          long long out = 0;
+          double    us;
+
+          stretch_reset();
+          stretch_set_speed( speeds[i] );
+
+          cpu0 = direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID );
+
+          for (j = 0; j + block <= samplerate * seconds; j += block)
+               out += stretch_process( in + j * channels, block );
+
+          cpu = direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID ) - cpu0;
+
+          /* per second of output, which is what playback consumes */
+          us = out ? cpu * (double) samplerate / out / channels : 0.0;
+
+          printf( "%-8.2f %12.2f %20.1f %18.3f\n", speeds[i], (double) out / samplerate, us, us / 10000 );
+     }
+
+     stretch_free();
+
+     D_FREE( in );
+}
+
+static void pipeline_release()
+{
+     if (pipeline.buffer) {
+          pipeline.buffer->Release( pipeline.buffer );
+          pipeline.buffer = NULL;
+     }
+}
+
+static void pipeline_free_scratch()
+{
+     if (pipeline.prev) D_FREE( pipeline.prev );
+     if (pipeline.in)   D_FREE( pipeline.in );
+     if (pipeline.out)  D_FREE( pipeline.out );
+     if (pipeline.pcm)  D_FREE( pipeline.pcm );
+
+     pipeline.prev = pipeline.in = pipeline.out = pipeline.pcm = NULL;
+
+     pipeline.in_samples = pipeline.out_samples = 0;
+}
+
+static DirectResult pipeline_setup( IFusionSoundMusicProvider *provider, const FSStreamDescription *dst )
+{
+     DirectResult        ret;
+     FSBufferDescription src;
+     int                 channels;
+     int                 in_frames, out_frames;
+
+     /* decode in the native format of the track */
+     ret = provider->GetBufferDescription( provider, &src );
+     if (ret)
+          return ret;
+
+     if (!pipeline.buffer                              ||
+         pipeline.src.length       != src.length       ||
+         pipeline.src.channels     != src.channels     ||
+         pipeline.src.sampleformat != src.sampleformat ||
+         pipeline.src.samplerate   != src.samplerate) {
+          pipeline_release();
+
+          ret = sound->CreateBuffer( sound, &src, &pipeline.buffer );
+          if (ret)
+               return ret;
+
+          pipeline.buffer->GetDescription( pipeline.buffer, &pipeline.src );
+     }
+
+     pipeline.dst    = *dst;
+     pipeline.step   = (double) pipeline.src.samplerate / pipeline.dst.samplerate;
+     pipeline.phase  = 0;
+     pipeline.primed = 0;
+
+     /* scratch buffers are sized for the larger channel count, as the channel mapping is done in place */
+     channels   = MAX( pipeline.src.channels, pipeline.dst.channels );
+     in_frames  = pipeline.src.length;
+     out_frames = in_frames / pipeline.step + 2;
+
+     /* the time-stretch writes up to 1 / STRETCH_MIN times the resampled frames plus pending grains */
+     if (time_stretch) {
+          out_frames = out_frames / STRETCH_MIN + pipeline.dst.samplerate * STRETCH_WINDOW / 2000;
+
+          ret = stretch_setup( pipeline.dst.channels, pipeline.dst.samplerate, out_frames );
+          if (ret)
+               return ret;
+
+          /* nothing of the previous track or position is overlap-added into the new one */
+          stretch_reset();
+     }
+
+     if (in_frames * channels > pipeline.in_samples || out_frames * channels > pipeline.out_samples) {
+          pipeline_free_scratch();
+
+          pipeline.in   = D_MALLOC( in_frames * channels * sizeof(float) );
+          pipeline.out  = D_MALLOC( out_frames * channels * sizeof(float) );
+          pipeline.pcm  = D_MALLOC( out_frames * channels * sizeof(s32) );
+
+          if (!pipeline.in || !pipeline.out || !pipeline.pcm) {
+               pipeline_free_scratch();
+               return D_OOM();
+          }
+
+          pipeline.in_samples  = in_frames * channels;
+          pipeline.out_samples = out_frames * channels;
+     }
+
+     pipeline.prev = D_REALLOC( pipeline.prev, pipeline.dst.channels * sizeof(float) );
+     if (!pipeline.prev)
+          return D_OOM();
+
+     return DR_OK;
+}
+
+/* convert decoded frames to the output format, returns the number of output frames in pipeline.pcm */
+static int pipeline_process( const void *data, int frames )
+{
+     int    i, c;
+     int    n;
+     int    sch = pipeline.src.channels;
+     int    dch = pipeline.dst.channels;
+     float *in  = pipeline.in;
+     float *out = pipeline.out;
+
+     frames = MIN( frames, pipeline.in_samples / MAX( sch, dch ) );
+
+     pcm_to_float( data, pipeline.src.sampleformat, frames * sch, in );
+
+     /* channel mapping, done in place as the scratch buffers are sized for the larger channel count */
+     if (sch != dch) {
+          if (sch == 1) {
+               for (i = frames - 1; i >= 0; i--)
+                    for (c = 0; c < dch; c++)
+                         in[i * dch + c] = in[i];
+          }
+          else if (dch == 1) {
+               for (i = 0; i < frames; i++) {
+                    float sum = 0;
+
+                    for (c = 0; c < sch; c++)
+                         sum += in[i * sch + c];
+
+                    in[i] = sum / sch;
+               }
+          }
+          else if (sch > dch) {
+               for (i = 0; i < frames; i++)
+                    for (c = 0; c < dch; c++)
+                         in[i * dch + c] = in[i * sch + c];
+          }
+          else {
+               for (i = frames - 1; i >= 0; i--) {
+                    for (c = dch - 1; c >= sch; c--)
+                         in[i * dch + c] = 0;
+                    for (c = sch - 1; c >= 0; c--)
+                         in[i * dch + c] = in[i * sch + c];
+               }
+          }
+     }
+
+     /* linear resampling */
+     if (pipeline.src.samplerate == pipeline.dst.samplerate) {
+          out = in;
+          n   = frames;
+     }
+     else {
+          double pos;
+
+          /* start at the first frame of the track */
+          if (!pipeline.primed) {
+               memcpy( pipeline.prev, in, dch * sizeof(float) );
+               pipeline.phase  = 1;
+               pipeline.primed = 1;
+          }
+
+          pos = pipeline.phase;
+
+          /* positions are relative to the last frame of the previous block */
+          for (n = 0; pos < frames && n < pipeline.out_samples / dch; n++, pos += pipeline.step) {
+               int          index = pos;
+               float        frac  = pos - index;
+               const float *a     = index ? &in[(index - 1) * dch] : pipeline.prev;
+               const float *b     = &in[index * dch];
+
+               for (c = 0; c < dch; c++)
+                    out[n * dch + c] = a[c] + (b[c] - a[c]) * frac;
+          }
+
+          pipeline.phase = pos - frames;
+
+          memcpy( pipeline.prev, &in[(frames - 1) * dch], dch * sizeof(float) );
+     }
+
+     /* change the speed without changing the pitch */
+     if (time_stretch) {
+          long long t0 = direct_clock_get_micros();
+
+          stretch.frames += n;
+
+          n   = stretch_process( out, n );
+          out = stretch.out;
+
+          stretch.time += direct_clock_get_micros() - t0;
+     }
+
+     float_to_pcm( out, n * dch, pipeline.dst.sampleformat, pipeline.pcm );
+
+     return n;
+}
+
+/*
+ * Level meter kernels, using vectors of 8 samples: lane i belongs to channel i % channels when the number of
+ * channels divides 8, other channel counts and remaining samples are handled by the scalar path.
+ */
+
+typedef float v8sf __attribute__((vector_size(32)));
+typedef s32   v8si __attribute__((vector_size(32)));
+typedef s16   v8hi __attribute__((vector_size(16)));
+typedef u8    v8qu __attribute__((vector_size(8)));
+
+static inline float meter_sample( const void *data, FSSampleFormat format, int i )
+{
+     switch (format) {
+          case FSSF_U8:
+               return (((const u8*) data)[i] - 128) / 128.0f;
+          case FSSF_S16:
+               return ((const s16*) data)[i] / 32768.0f;
+          case FSSF_S24: {
+               const u8 *p = (const u8*) data + i * 3;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+               return (((s8) p[0] << 16) | (p[1] << 8) | p[2]) / 8388608.0f;
+#else
+               return (((s8) p[2] << 16) | (p[1] << 8) | p[0]) / 8388608.0f;
+#endif
+          }
+          case FSSF_S32:
+               return ((const s32*) data)[i] / 2147483648.0f;
+          case FSSF_FLOAT:
+               return ((const float*) data)[i];
+          default:
+               return 0;
+     }
+}
+
+static inline void meter_load( const void *data, FSSampleFormat format, int i, v8sf *ret )
+{
+     v8qu b;
+     v8hi h;
+     v8si w;
+     int  j;
+
+     switch (format) {
+          case FSSF_U8:
+               memcpy( &b, (const u8*) data + i, sizeof(b) );
+               w    = __builtin_convertvector( b, v8si ) - 128;
+               *ret = __builtin_convertvector( w, v8sf ) * (1 / 128.0f);
+               break;
+          case FSSF_S16:
+               memcpy( &h, (const s16*) data + i, sizeof(h) );
+               w    = __builtin_convertvector( h, v8si );
+               *ret = __builtin_convertvector( w, v8sf ) * (1 / 32768.0f);
+               break;
+          case FSSF_S24:
+               for (j = 0; j < 8; j++) {
+                    const u8 *p = (const u8*) data + (i + j) * 3;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                    w[j] = ((s8) p[0] << 16) | (p[1] << 8) | p[2];
+#else
+                    w[j] = ((s8) p[2] << 16) | (p[1] << 8) | p[0];
+#endif
+               }
+               *ret = __builtin_convertvector( w, v8sf ) * (1 / 8388608.0f);
+               break;
+          case FSSF_S32:
+               memcpy( &w, (const s32*) data + i, sizeof(w) );
+               *ret = __builtin_convertvector( w, v8sf ) * (1 / 2147483648.0f);
+               break;
+          case FSSF_FLOAT:
+               memcpy( ret, (const float*) data + i, sizeof(*ret) );
+               break;
+          default:
+               *ret = (v8sf) {};
+               break;
+     }
+}
+
+static void meter_process( const void *data, FSSampleFormat format, int channels, int frames )
+{
+     float  peak[METER_CHANNELS] = { 0 };
+     double sum[METER_CHANNELS]  = { 0 };
+     int    samples = frames * channels;
+     int    i = 0;
+     int    c;
+
+     if (channels > METER_CHANNELS)
+          return;
+
+     if (8 % channels == 0) {
+          v8si vpeak = {};
+          v8sf vsum  = {};
+          int  l;
+
+          for (; i + 8 <= samples; i += 8) {
+               v8sf v;
+               v8si a, m;
+
+               meter_load( data, format, i, &v );
+
+               a = (v8si) v & 0x7fffffff;
+               m = a > vpeak;
+
+               /* absolute values of floats compare like integers */
+               vpeak = (a & m) | (vpeak & ~m);
+               vsum += v * v;
+          }
+
+          for (l = 0; l < 8; l++) {
+               union { s32 i; float f; } p = { .i = vpeak[l] };
+
+               c = l % channels;
+
+               peak[c]  = MAX( peak[c], p.f );
+               sum[c]  += vsum[l];
+          }
+     }
+
+     for (; i < samples; i++) {
+          float v = meter_sample( data, format, i );
+
+          c = i % channels;
+
+          peak[c]  = MAX( peak[c], fabsf( v ) );
+          sum[c]  += v * v;
+     }
+
+     direct_mutex_lock( &level_meter.lock );
+
+     if (level_meter.channels != channels) {
+          memset( level_meter.peak, 0, sizeof(level_meter.peak) );
+          memset( level_meter.sum, 0, sizeof(level_meter.sum) );
+          level_meter.frames   = 0;
+          level_meter.channels = channels;
+     }
+
+     for (c = 0; c < channels; c++) {
+          level_meter.peak[c]  = MAX( level_meter.peak[c], peak[c] );
+          level_meter.sum[c]  += sum[c];
+     }
+
+     level_meter.frames += frames;
+
+     direct_mutex_unlock( &level_meter.lock );
+}
+
+/* print peak and RMS levels in dBFS since the last call */
+static void meter_print()
+{
+     int c;
+
+     direct_mutex_lock( &level_meter.lock );
+
+     if (level_meter.frames) {
+          fprintf( stderr, "[Peak/RMS dB:" );
+
+          for (c = 0; c < level_meter.channels; c++) {
+               float peak = level_meter.peak[c] > 0 ? 20 * log10f( level_meter.peak[c] ) : -99;
+               float rms  = level_meter.sum[c] > 0 ? 10 * log10( level_meter.sum[c] / level_meter.frames ) : -99;
+
+               fprintf( stderr, " %5.1f/%5.1f", MAX( peak, -99 ), MAX( rms, -99 ) );
+          }
+
+          fprintf( stderr, "] " );
+
+          memset( level_meter.peak, 0, sizeof(level_meter.peak) );
+          memset( level_meter.sum, 0, sizeof(level_meter.sum) );
+          level_meter.frames = 0;
+     }
+
+     direct_mutex_unlock( &level_meter.lock );
+}
+
+/******************************************************************************/
+
+/* touch the stack the calling thread may use, so that no page faults happen later */
+static void realtime_prefault_stack()
+{
+     char stack[REALTIME_STACK];
+
+     memset( stack, 0, sizeof(stack) );
+
+     /* keep the stores */
+     __asm__ __volatile__( "" : : "r" (stack) : "memory" );
+}
+
+/* switch the calling thread to SCHED_FIFO, a thread id of 0 is the calling thread and not the whole process */
+static int realtime_enter()
+{
+     struct sched_param param;
+
+     realtime_thread = 1;
+
+     memset( &param, 0, sizeof(param) );
+     param.sched_priority = realtime;
+
+     if (sched_setscheduler( 0, SCHED_FIFO, &param )) {
+          if (!rt.failed++)
+               fprintf( stderr, "Failed to set SCHED_FIFO priority %d, check RLIMIT_RTPRIO!\n", realtime );
+          return -1;
+     }
+
+     realtime_prefault_stack();
+
+     return 0;
+}
+
+static void realtime_init()
+{
+     void *heap;
+
+     /* freed memory is neither returned to the system nor allocated with mmap, so it stays locked and faulted in */
+     mallopt( M_TRIM_THRESHOLD, -1 );
+     mallopt( M_MMAP_MAX, 0 );
+
+     if (mlockall( MCL_CURRENT | MCL_FUTURE ))
+          fprintf( stderr, "Failed to lock memory, check RLIMIT_MEMLOCK!\n" );
+     else
+          rt.locked = 1;
+
+     /* grow the heap once, buffers allocated later on reuse these pages */
+     heap = D_MALLOC( REALTIME_HEAP );
+     if (heap) {
+          memset( heap, 0, REALTIME_HEAP );
+          D_FREE( heap );
+     }
+
+     realtime_prefault_stack();
+}
+
+static void *realtime_probe( DirectThread *thread, void *arg )
+{
+     struct timespec next;
+     int             was_filled  = 0;
+     int             in_underrun = 0;
+
+     /* the probe measures the wakeup latency the feeding path would see */
+     if (realtime)
+          realtime_enter();
+
+     clock_gettime( CLOCK_MONOTONIC, &next );
+
+     while (!rt.stop) {
+          struct timespec now;
+          long long       latency;
+
+          next.tv_nsec += REALTIME_PERIOD * 1000;
+          if (next.tv_nsec >= 1000000000) {
+               next.tv_nsec -= 1000000000;
+               next.tv_sec++;
+          }
+
+          clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL );
+
+          clock_gettime( CLOCK_MONOTONIC, &now );
+
+          latency = (now.tv_sec - next.tv_sec) * 1000000LL + (now.tv_nsec - next.tv_nsec) / 1000;
+
+          rt.wakeups++;
+          rt.latency_sum += latency;
+          rt.latency_max  = MAX( rt.latency_max, latency );
+
+          /* do not count the missed periods again */
+          if (latency > REALTIME_PERIOD) {
+               rt.late++;
+               next = now;
+          }
+
+          /* an empty ring buffer after it has been filled during a track is an underrun, checked every period */
+          direct_mutex_lock( &rt.lock );
+
+          if (rt.active) {
+               int filled = 0;
+
+               stream->GetStatus( stream, &filled, NULL, NULL, NULL, NULL );
+
+               if (filled)
+                    was_filled = 1;
+               else if (was_filled && !in_underrun)
+                    rt.underruns++;
+
+               in_underrun = was_filled && !filled;
+          }
+          else
+               was_filled = in_underrun = 0;
+
+          direct_mutex_unlock( &rt.lock );
+     }
+
+     return NULL;
+}
+
+/* the main loop marks the playback of a track, the stream may only be released or replaced while inactive */
+static void realtime_set_active( int active )
+{
+     if (!rt.probe) {
+          rt.active = active;
+          return;
+     }
+
+     direct_mutex_lock( &rt.lock );
+
+     rt.active = active;
+
+     direct_mutex_unlock( &rt.lock );
+}
+
+/* synthetic load: arithmetic and page faults on a fresh mapping, only system calls after fork() */
+static void stress_process()
+{
+     volatile double x = 1;
+     int             i = 0;
+
+     while (1) {
+          void *mem = mmap( NULL, STRESS_MEMORY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+          if (mem != MAP_FAILED) {
+               memset( mem, i & 0xff, STRESS_MEMORY );
+               munmap( mem, STRESS_MEMORY );
+          }
+
+          for (i = 0; i < 10000000; i++)
+               x = x * 1.0000001 + 1;
+     }
+}
+
+static void stress_start()
+{
+     int   i;
+     pid_t parent = getpid();
+
+     rt.stress_pids = D_CALLOC( stress, sizeof(pid_t) );
+     if (!rt.stress_pids) {
+          D_OOM();
+          return;
+     }
+
+     for (i = 0; i < stress; i++) {
+          pid_t pid = fork();
+
+          if (pid < 0) {
+               fprintf( stderr, "Failed to start stress process!\n" );
+               break;
+          }
+
+          if (!pid) {
+               /* do not outlive the player, even if it is killed or crashes */
+               prctl( PR_SET_PDEATHSIG, SIGKILL );
+
+               /* the player may have died before the death signal was set up */
+               if (getppid() != parent)
+                    _exit( 0 );
+
+               stress_process();
+               _exit( 0 );
+          }
+
+          rt.stress_pids[rt.stress_count++] = pid;
+     }
+}
+
+static void realtime_start()
+{
+     if (stress)
+          stress_start();
+
+     if (realtime)
+          realtime_init();
+
+     direct_mutex_init( &rt.lock );
+
+     rt.probe = direct_thread_create( DTT_DEFAULT, realtime_probe, NULL, "Latency Probe" );
+     if (!rt.probe)
+          direct_mutex_deinit( &rt.lock );
+}
+
+static void realtime_shutdown()
+{
+     int i;
+
+     if (rt.probe) {
+          rt.stop = 1;
+
+          direct_thread_join( rt.probe );
+          direct_thread_destroy( rt.probe );
+          rt.probe = NULL;
+
+          direct_mutex_deinit( &rt.lock );
+     }
+
+     for (i = 0; i < rt.stress_count; i++) {
+          kill( rt.stress_pids[i], SIGKILL );
+          waitpid( rt.stress_pids[i], NULL, 0 );
+     }
+
+     rt.stress_count = 0;
+
+     if (rt.stress_pids) {
+          D_FREE( rt.stress_pids );
+          rt.stress_pids = NULL;
+     }
+}
+
+static void print_realtime_stats()
+{
+     if (realtime)
+          fprintf( stderr, "Realtime: SCHED_FIFO priority %d for %d feeding thread(s), memory %s, %d stress process(es)\n",
+                   realtime, rt.feeders, rt.locked ? "locked" : "not locked", rt.stress_count );
+     else
+          fprintf( stderr, "Realtime: off, %d stress process(es)\n", rt.stress_count );
+
+     if (rt.wakeups)
+          fprintf( stderr, "Wakeup latency: %lld wakeups every %d us, average %.1f us, max %lld us, %lld late by more "
+                   "than a period, %d underruns\n", rt.wakeups, REALTIME_PERIOD, (double) rt.latency_sum / rt.wakeups,
+                   rt.latency_max, rt.late, rt.underruns );
+}
+
+/******************************************************************************/
+
+static void *dump_thread( DirectThread *thread, void *arg )
+{
+     direct_mutex_lock( &dump.lock );
+
+     while (1) {
+          int       index;
+          int       length;
+          long long t0;
+
+          while (dump.pending < 0 && !dump.stop)
+               direct_waitqueue_wait( &dump.cond, &dump.lock );
+
+          if (dump.pending < 0)
+               break;
+
+          index = dump.pending;
+
+          direct_mutex_unlock( &dump.lock );
+
+          /* direct I/O needs whole blocks, the padding of the last one is truncated when closing */
+          length = dump.direct ? (dump.fill[index] + DUMP_ALIGN - 1) & ~(DUMP_ALIGN - 1) : dump.fill[index];
+
+          t0 = direct_clock_get_micros();
+
+          if (write( dump.fd, dump.buffers[index], length ) != length)
+               fprintf( stderr, "Failed to write to '%s'!\n", dump_file );
+
+          /* keep the page cache clean of the capture */
+          if (dump.fadvise) {
+               fdatasync( dump.fd );
+               posix_fadvise( dump.fd, dump.offset, length, POSIX_FADV_DONTNEED );
+          }
+
+          dump.offset     += length;
+          dump.write_time += direct_clock_get_micros() - t0;
+
+          direct_mutex_lock( &dump.lock );
+
+          dump.pending = -1;
+
+          direct_waitqueue_broadcast( &dump.cond );
+     }
+
+     direct_mutex_unlock( &dump.lock );
+
+     return NULL;
+}
+
+static void dump_le32( u8 *p, u32 v )
+{
+     p[0] = v;
+     p[1] = v >> 8;
+     p[2] = v >> 16;
+     p[3] = v >> 24;
+}
+
+static void dump_header( u8 *header, long long bytes )
+{
+     int bits  = FS_BITS_PER_SAMPLE(dump.format);
+     int align = dump.channels * bits / 8;
+
+     memcpy( header, "RIFF\0\0\0\0WAVEfmt \x10\0\0\0", 20 );
+     dump_le32( header + 4, 36 + bytes );
+
+     /* PCM or IEEE float */
+     header[20] = dump.format == FSSF_FLOAT ? 3 : 1;
+     header[21] = 0;
+     header[22] = dump.channels;
+     header[23] = 0;
+     dump_le32( header + 24, dump.samplerate );
+     dump_le32( header + 28, dump.samplerate * align );
+     header[32] = align;
+     header[33] = align >> 8;
+     header[34] = bits;
+     header[35] = 0;
+
+     memcpy( header + 36, "data", 4 );
+     dump_le32( header + 40, bytes );
+}
+
+static DirectResult dump_open( FSSampleFormat format, int channels, int samplerate )
+{
+     const char *ext = strrchr( dump_file, '.' );
+     int         flags = O_WRONLY | O_CREAT | O_TRUNC;
+     int         i;
+
+     dump.direct  = dump_io && !strcmp( dump_io, "direct" );
+     dump.fadvise = dump_io && !strcmp( dump_io, "fadvise" );
+     dump.raw     = !ext || strcasecmp( ext, ".wav" );
+
+#ifdef O_DIRECT
+     if (dump.direct)
+          flags |= O_DIRECT;
+#else
+     if (dump.direct) {
+          fprintf( stderr, "Direct I/O is not available, writing through the page cache.\n" );
+          dump.direct = 0;
+     }
+#endif
+
+     dump.fd = open( dump_file, flags, 0644 );
+     if (dump.fd < 0) {
+          fprintf( stderr, "Failed to open dump file '%s'!\n", dump_file );
+          return DR_IO;
+     }
+
+     for (i = 0; i < 2; i++) {
+          if (posix_memalign( (void**) &dump.buffers[i], DUMP_ALIGN, DUMP_BUFFER )) {
+               close( dump.fd );
+               dump.fd = -1;
+               return D_OOM();
+          }
+
+          dump.fill[i] = 0;
+     }
+
+     dump.format     = format;
+     dump.channels   = channels;
+     dump.samplerate = samplerate;
+     dump.current    = 0;
+     dump.pending    = -1;
+     dump.start      = direct_clock_get_micros();
+
+     /* the header is written with the first buffer and completed when closing */
+     if (!dump.raw)
+          dump.fill[0] = 44;
+
+     direct_mutex_init( &dump.lock );
+     direct_waitqueue_init( &dump.cond );
+
+     dump.thread = direct_thread_create( DTT_DEFAULT, dump_thread, NULL, "Dump Writer" );
+
+     return DR_OK;
+}
+
+/* hand the current buffer to the writer, waiting for the other one to be written */
+static void dump_flush( int wait )
+{
+     long long t0 = direct_clock_get_micros();
+     long long stall;
+
+     direct_mutex_lock( &dump.lock );
+
+     while (dump.pending >= 0)
+          direct_waitqueue_wait( &dump.cond, &dump.lock );
+
+     stall = direct_clock_get_micros() - t0;
+     if (stall > 1000) {
+          dump.stalls++;
+          dump.stall_total += stall;
+          dump.stall_max    = MAX( dump.stall_max, stall );
+     }
+
+     dump.pending = dump.current;
+
+     direct_waitqueue_broadcast( &dump.cond );
+
+     if (wait) {
+          while (dump.pending >= 0)
+               direct_waitqueue_wait( &dump.cond, &dump.lock );
+     }
+
+     direct_mutex_unlock( &dump.lock );
+
+     dump.current ^= 1;
+     dump.fill[dump.current] = 0;
+}
+
+static void dump_data( const void *data, int frames, const FSBufferDescription *desc )
+{
+     const u8 *src = data;
+     int       bytes;
+
+     if (dump.fd < 0) {
+          if (dump_open( desc->sampleformat, desc->channels, desc->samplerate ))
+               dump_file = NULL;
+          if (!dump_file)
+               return;
+     }
+
+     /* one format per file */
+     if (desc->sampleformat != dump.format || desc->channels != dump.channels || desc->samplerate != dump.samplerate) {
+          dump.mismatch++;
+          return;
+     }
+
+     bytes = frames * desc->channels * FS_BYTES_PER_SAMPLE(desc->sampleformat);
+
+     dump.bytes += bytes;
+
+     while (bytes) {
+          int length = MIN( bytes, DUMP_BUFFER - dump.fill[dump.current] );
+
+          memcpy( dump.buffers[dump.current] + dump.fill[dump.current], src, length );
+
+          dump.fill[dump.current] += length;
+          src                     += length;
+          bytes                   -= length;
+
+          if (dump.fill[dump.current] == DUMP_BUFFER)
+               dump_flush( 0 );
+     }
+}
+
+static void dump_close()
+{
+     long long size;
+     long long wall;
+     int       i;
+
+     if (dump.fd < 0)
+          return;
+
+     size = dump.bytes + (dump.raw ? 0 : 44);
+
+     if (dump.fill[dump.current])
+          dump_flush( 1 );
+
+     direct_mutex_lock( &dump.lock );
+     dump.stop = 1;
+     direct_waitqueue_broadcast( &dump.cond );
+     direct_mutex_unlock( &dump.lock );
+
+     direct_thread_join( dump.thread );
+     direct_thread_destroy( dump.thread );
+
+     direct_waitqueue_deinit( &dump.cond );
+     direct_mutex_deinit( &dump.lock );
+
+     close( dump.fd );
+
+     wall = direct_clock_get_micros() - dump.start;
+
+     /* drop the padding of direct I/O and complete the header through the page cache */
+     dump.fd = open( dump_file, O_WRONLY );
+     if (dump.fd >= 0) {
+          if (ftruncate( dump.fd, size ))
+               fprintf( stderr, "Failed to truncate '%s'!\n", dump_file );
+
+          if (!dump.raw) {
+               u8 header[44];
+
+               dump_header( header, dump.bytes );
+
+               if (pwrite( dump.fd, header, sizeof(header), 0 ) != sizeof(header))
+                    fprintf( stderr, "Failed to write the header of '%s'!\n", dump_file );
+          }
+
+          close( dump.fd );
+     }
+
+     dump.fd = -1;
+
+     for (i = 0; i < 2; i++)
+          free( dump.buffers[i] );
+
+     fprintf( stderr, "Dump: %lld bytes to '%s' (%s, %s I/O), %.1f MB/s written, %.1f MB/s overall, "
+              "%d stalls of the decoder (max %lld.%03lld ms, total %lld ms)\n", size, dump_file,
+              dump.raw ? "raw" : "WAV", dump.direct ? "direct" : dump.fadvise ? "fadvise" : "buffered",
+              dump.write_time ? dump.offset / (double) dump.write_time : 0.0, wall ? size / (double) wall : 0.0,
+              dump.stalls, dump.stall_max / 1000, dump.stall_max % 1000, dump.stall_total / 1000 );
+
+     if (dump.mismatch)
+          fprintf( stderr, "Dump: %d blocks of tracks in another format than the first one were skipped\n",
+                   dump.mismatch );
+}
+
+static int dump_cb( int length, void *ctx )
+{
+     IFusionSoundBuffer  *buffer = ctx;
+     FSBufferDescription  desc;
+     void                *data;
+
+     buffer->GetDescription( buffer, &desc );
+
+     if (buffer->Lock( buffer, &data, NULL, NULL ))
+          return 0;
+
+     dump_data( data, MIN( length, desc.length ), &desc );
+
+     buffer->Unlock( buffer );
+
+     return 0;
+}
+
+/* decode all tracks to the dump file without playback */
+static void run_dump()
+{
+     Media     *media;
+     int        t;
+     long long  frames = 0;
+     long long  t0     = direct_clock_get_micros();
+     double     audio  = 0;
+     long long  wall;
+
+     for (media = playlist.medias; media < playlist.medias + playlist.count; media++) {
+          IFusionSoundMusicProvider *provider;
+
+          if (sound->CreateMusicProvider( sound, media->mrl, &provider )) {
+               fprintf( stderr, "Failed to create music provider for '%s'!\n", media->mrl );
+               continue;
+          }
+
+          provider->EnumTracks( provider, track_cb, media );
+
+          for (t = 0; t < media->tracks.count; t++) {
+               FSBufferDescription    bdsc;
+               IFusionSoundBuffer    *buffer;
+               FSMusicProviderStatus  status = FMSTATE_UNKNOWN;
+               long long              bytes  = dump.bytes;
+
+               if (provider->SelectTrack( provider, media->tracks.ids[t] ))
+                    continue;
+
+               provider->GetBufferDescription( provider, &bdsc );
+
+               if (sound->CreateBuffer( sound, &bdsc, &buffer ))
+                    continue;
+
+               if (provider->PlayToBuffer( provider, buffer, dump_cb, buffer ) == DR_OK) {
+                    while (status != FMSTATE_FINISHED && status != FMSTATE_STOP) {
+                         provider->WaitStatus( provider, FMSTATE_FINISHED | FMSTATE_STOP, 0 );
+                         provider->GetStatus( provider, &status );
+                    }
+
+                    provider->Stop( provider );
+               }
+
+               buffer->Release( buffer );
+
+               frames  = (dump.bytes - bytes) / (bdsc.channels * FS_BYTES_PER_SAMPLE(bdsc.sampleformat));
+               audio  += (double) frames / bdsc.samplerate;
+          }
+
+          provider->Release( provider );
+
+          track_list_clear( &media->tracks );
+     }
+
+     dump_close();
+
+     wall = direct_clock_get_micros() - t0;
+
+     fprintf( stderr, "Dump: %.2f s of audio in %lld.%03lld s, %.1fx realtime\n", audio, wall / 1000000,
+              wall / 1000 % 1000, wall ? audio * 1000000 / wall : 0.0 );
+}
+
+/******************************************************************************/
+
+static int pipeline_cb( int length, void *ctx )
+{
+     void *data;
+     void *out;
+     int   frames;
+
+     /* the decoding thread feeds the stream, a new one is created with each music provider */
+     if (realtime && !realtime_thread && !realtime_enter())
+          rt.feeders++;
+
+     /* measure the gap to the end of the previous track */
+     if (pipeline.end_time) {
+          int       filled = 0;
+          long long drained;
+
+          stream->GetStatus( stream, &filled, NULL, NULL, NULL, NULL );
+
+          drained = (direct_clock_get_micros() - pipeline.end_time) * pipeline.dst.samplerate / 1000000;
+
+          if (!filled && drained > pipeline.end_filled) {
+               int gap = drained - pipeline.end_filled;
+
+               pipeline.gap_total += gap;
+               pipeline.gap_max    = MAX( pipeline.gap_max, gap );
+          }
+
+          pipeline.transitions++;
+          pipeline.end_time = 0;
+     }
+
+     if (pipeline.buffer->Lock( pipeline.buffer, &data, NULL, NULL ))
+          return 0;
+
+     /* capture the decoded audio before any conversion */
+     if (dump_file)
+          dump_data( data, MIN( length, pipeline.src.length ), &pipeline.src );
+
+     /* pass through when the track is in the stream format */
+     if (!time_stretch                                         &&
+         pipeline.src.channels     == pipeline.dst.channels     &&
+         pipeline.src.sampleformat == pipeline.dst.sampleformat &&
+         pipeline.src.samplerate   == pipeline.dst.samplerate) {
+          out    = data;
+          frames = length;
+     }
+     else {
+          out    = pipeline.pcm;
+          frames = pipeline_process( data, length );
+     }
+
+     if (meter && frames) {
+          long long t0 = direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID );
+
+          meter_process( out, pipeline.dst.sampleformat, pipeline.dst.channels, frames );
+
+          level_meter.time         += direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID ) - t0;
+          level_meter.total_frames += frames;
+          level_meter.samplerate    = pipeline.dst.samplerate;
+     }
+
+     if (frames)
+          stream->Write( stream, out, frames );
+
+     pipeline.buffer->Unlock( pipeline.buffer );
+
+     return 0;
+}
+
+static void pipeline_mark_end()
+{
+     pipeline.end_filled = 0;
+
+     stream->GetStatus( stream, &pipeline.end_filled, NULL, NULL, NULL, NULL );
+
+     pipeline.end_time = direct_clock_get_micros();
+}
+
+/* change the playback speed with the pitch, or without it when time-stretching, returns the clamped speed */
+static float set_pitch( float pitch )
+{
+     if (time_stretch) {
+          pitch = CLAMP( pitch, STRETCH_MIN, STRETCH_MAX );
+
+          stretch_set_speed( pitch );
+
+          playback->SetPitch( playback, 1 );
+     }
+     else
+          playback->SetPitch( playback, pitch );
+
+     return pitch;
+}
+
+/* seek within the current track, without time-stretching across the old and the new position */
+static void seek_playback( IFusionSoundMusicProvider *provider, double seconds )
+{
+     provider->SeekTo( provider, seconds );
+
+     if (time_stretch)
+          stretch_request_reset();
+}
+
+static void fader_destroy( Fader *fader )
+{
+     if (fader->buffer) fader->buffer->Release( fader->buffer );
+     if (fader->stream) fader->stream->Release( fader->stream );
+     if (fader->in)     D_FREE( fader->in );
+     if (fader->pcm)    D_FREE( fader->pcm );
+
+     direct_waitqueue_deinit( &fader->cond );
+     direct_mutex_deinit( &fader->lock );
+
+     D_FREE( fader );
+}
+
+/* decode the track of the provider into a buffer, written by the fader to the current stream */
+static DirectResult fader_setup( IFusionSoundMusicProvider *provider )
+{
+     DirectResult        ret;
+     FSStreamDescription dsc;
+     Fader              *new_fader;
+
+     new_fader = D_CALLOC( 1, sizeof(Fader) );
+     if (!new_fader)
+          return D_OOM();
+
+     direct_mutex_init( &new_fader->lock );
+     direct_waitqueue_init( &new_fader->cond );
+
+     new_fader->fade_start = -1;
+
+     stream->GetDescription( stream, &dsc );
+
+     ret = provider->GetBufferDescription( provider, &new_fader->src );
+     if (ret == DR_OK && (new_fader->src.channels != dsc.channels || new_fader->src.samplerate != dsc.samplerate))
+          ret = DR_UNSUPPORTED;
+
+     if (ret == DR_OK)
+          ret = sound->CreateBuffer( sound, &new_fader->src, &new_fader->buffer );
+
+     if (ret) {
+          fader_destroy( new_fader );
+          return ret;
+     }
+
+     new_fader->buffer->GetDescription( new_fader->buffer, &new_fader->src );
+
+     new_fader->format = dsc.sampleformat;
+     new_fader->in     = D_MALLOC( new_fader->src.length * dsc.channels * sizeof(float) );
+     new_fader->pcm    = D_MALLOC( new_fader->src.length * dsc.channels * sizeof(s32) );
+
+     if (!new_fader->in || !new_fader->pcm) {
+          fader_destroy( new_fader );
+          return D_OOM();
+     }
+
+     stream->AddRef( stream );
+     new_fader->stream = stream;
+
+     if (track_fader)
+          fader_destroy( track_fader );
+
+     track_fader = new_fader;
+
+     return DR_OK;
+}
+
+/* start a ramp with the next block written, up for the incoming and down for the ending track */
+static void fader_start_ramp( Fader *fader, int fade_out )
+{
+     direct_mutex_lock( &fader->lock );
+
+     fader->request = fade_out ? 2 : 1;
+
+     direct_mutex_unlock( &fader->lock );
+}
+
+static int fader_cb( int length, void *ctx )
+{
+     Fader     *fader    = ctx;
+     int        channels = fader->src.channels;
+     void      *data;
+     void      *out;
+     long long  first, begin, ramp;
+     int        fade_out;
+     int        frames   = MIN( length, fader->src.length );
+     int        i, c;
+
+     if (fader->buffer->Lock( fader->buffer, &data, NULL, NULL ))
+          return 0;
+
+     direct_mutex_lock( &fader->lock );
+
+     if (fader->request) {
+          fader->fade_start  = fader->frames;
+          fader->fade_length = MAX( (long long) crossfade * fader->src.samplerate / 1000, 1 );
+          fader->fade_out    = fader->request == 2;
+          fader->request     = 0;
+     }
+
+     first    = fader->frames;
+     begin    = fader->fade_start;
+     ramp     = fader->fade_length;
+     fade_out = fader->fade_out;
+
+     if (fader->done)
+          frames = 0;
+
+     direct_mutex_unlock( &fader->lock );
+
+     /* nothing of the ending track is written after its ramp */
+     if (begin >= 0 && fade_out)
+          frames = CLAMP( begin + ramp - first, 0, frames );
+
+     if (frames && begin >= 0 && first + frames > begin && (fade_out || first < begin + ramp)) {
+          /* equal power curves, the gain of each frame follows from its position in the ramp */
+          pcm_to_float( data, fader->src.sampleformat, frames * channels, fader->in );
+
+          for (i = 0; i < frames; i++) {
+               double x = (double) (first + i - begin) / ramp;
+               float  gain;
+
+               if (x < 0)
+                    gain = fade_out ? 1 : 0;
+               else if (x >= 1)
+                    gain = fade_out ? 0 : 1;
+               else
+                    gain = fade_out ? cos( x * M_PI / 2 ) : sin( x * M_PI / 2 );
+
+               for (c = 0; c < channels; c++)
+                    fader->in[i * channels + c] *= gain;
+          }
+
+          float_to_pcm( fader->in, frames * channels, fader->format, fader->pcm );
+
+          out = fader->pcm;
+     }
+     else if (fader->src.sampleformat != fader->format) {
+          pcm_to_float( data, fader->src.sampleformat, frames * channels, fader->in );
+          float_to_pcm( fader->in, frames * channels, fader->format, fader->pcm );
+
+          out = fader->pcm;
+     }
+     else
+          out = data;
+
+     if (frames)
+          fader->stream->Write( fader->stream, out, frames );
+
+     fader->buffer->Unlock( fader->buffer );
+
+     direct_mutex_lock( &fader->lock );
+
+     fader->frames += frames;
+
+     if (begin >= 0 && fade_out && fader->frames >= begin + ramp && !fader->done) {
+          fader->done = 1;
+
+          direct_waitqueue_broadcast( &fader->cond );
+     }
+
+     direct_mutex_unlock( &fader->lock );
+
+     return 0;
+}
+
+static DirectResult start_playback( IFusionSoundMusicProvider *provider )
+{
+     if (pipeline.buffer)
+          return provider->PlayToBuffer( provider, pipeline.buffer, pipeline_cb, NULL );
+
+     if (track_fader)
+          return provider->PlayToBuffer( provider, track_fader->buffer, fader_cb, track_fader );
+
+     return provider->PlayToStream( provider, stream );
+}
+
+/******************************************************************************/
+
+/* get the resident set size in KiB */
+static long current_rss()
+{
+     long  pages = 0;
+     FILE *f;
+
+     f = fopen( "/proc/self/statm", "r" );
+     if (f) {
+          if (fscanf( f, "%*d %ld", &pages ) != 1)
+               pages = 0;
+
+          fclose( f );
+     }
+
+     return pages * (sysconf( _SC_PAGESIZE ) / 1024);
+}
+
+static CodecStats *lookup_codec_stats( const char *encoding )
+{
+     int i;
+
+     for (i = 0; i < codec_count; i++) {
+          if (!strcmp( codec_stats[i].encoding, encoding ))
+               return &codec_stats[i];
+     }
+
+     if (codec_count == codec_max) {
+          int         max   = codec_max ? codec_max * 2 : 16;
+          CodecStats *stats = D_REALLOC( codec_stats, max * sizeof(CodecStats) );
+
+          if (!stats) {
+               D_OOM();
+               return NULL;
+          }
+
+          codec_stats = stats;
+          codec_max   = max;
+     }
+
+     memset( &codec_stats[codec_count], 0, sizeof(CodecStats) );
+
+     snprintf( codec_stats[codec_count].encoding, sizeof(codec_stats[codec_count].encoding), "%s", encoding );
+
+     return &codec_stats[codec_count++];
+}
+
+static int bench_cb( int length, void *ctx )
+{
+     long long *frames = ctx;
+
+     *frames += length;
+
+     return 0;
+}
+
+static void bench_track( IFusionSoundMusicProvider *provider, Media *media, FSTrackID track_id )
+{
+     DirectResult           ret;
+     FSTrackDescription     desc;
+     FSBufferDescription    bdsc;
+     IFusionSoundBuffer    *buffer;
+     FSMusicProviderStatus  status = FMSTATE_UNKNOWN;
+     CodecStats            *stats;
+     long long              frames = 0;
+     long long              t0, cpu0;
+     long long              wall, cpu;
+     long                   rss0, rss;
+     long                   peak_rss;
+     double                 audio;
+
+     if (provider->SelectTrack( provider, track_id ))
+          return;
+
+     provider->GetTrackDescription( provider, &desc );
+     provider->GetBufferDescription( provider, &bdsc );
+
+     ret = sound->CreateBuffer( sound, &bdsc, &buffer );
+     if (ret) {
+          FusionSoundError( "CreateBuffer failed", ret );
+          return;
+     }
+
+     rss0     = current_rss();
+     peak_rss = rss0;
+
+     t0   = direct_clock_get_micros();
+     cpu0 = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID );
+
+     /* decode as fast as possible into a null sink */
+     ret = provider->PlayToBuffer( provider, buffer, bench_cb, &frames );
+     if (ret) {
+          FusionSoundError( "PlayToBuffer failed", ret );
+          buffer->Release( buffer );
+          return;
+     }
+
+     while (status != FMSTATE_FINISHED) {
+          if (provider->WaitStatus( provider, FMSTATE_FINISHED | FMSTATE_STOP, 10 ) != DR_TIMEOUT)
+               provider->GetStatus( provider, &status );
+
+          if (status == FMSTATE_STOP)
+               break;
+
+          rss = current_rss();
+          if (rss > peak_rss)
+               peak_rss = rss;
+     }
+
+     wall = direct_clock_get_micros() - t0;
+     cpu  = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID ) - cpu0;
+
+     provider->Stop( provider );
+
+     buffer->Release( buffer );
+
+     audio = (double) frames / bdsc.samplerate;
+
+     printf( "Track %d.%u (%s, %d Hz, %d channel(s)): %.2f s decoded in %lld.%03lld ms, realtime factor %.1f, "
+             "CPU %.2f ms per audio second, peak memory +%ld KiB\n", media->id, track_id,
+             *desc.encoding ? desc.encoding : "Unknown", bdsc.samplerate, bdsc.channels, audio, wall / 1000, wall % 1000,
+             wall ? audio * 1000000 / wall : 0.0, audio ? cpu / 1000.0 / audio : 0.0, peak_rss - rss0 );
+
+     stats = lookup_codec_stats( *desc.encoding ? desc.encoding : "Unknown" );
+     if (stats) {
+          stats->tracks++;
+          stats->audio   += audio;
+          stats->wall    += wall;
+          stats->cpu     += cpu;
+          stats->peak_rss = MAX( stats->peak_rss, peak_rss - rss0 );
+     }
+}
+
+static void run_bench()
+{
+     Media *media;
+     int    i, t;
+
+     for (media = playlist.medias; media < playlist.medias + playlist.count; media++) {
+          IFusionSoundMusicProvider *provider;
+
+          if (sound->CreateMusicProvider( sound, media->mrl, &provider )) {
+               fprintf( stderr, "Failed to create music provider for '%s'!\n", media->mrl );
+               continue;
+          }
+
+          provider->EnumTracks( provider, track_cb, media );
+
+          for (t = 0; t < media->tracks.count; t++)
+               bench_track( provider, media, media->tracks.ids[t] );
+
+          provider->Release( provider );
+
+          track_list_clear( &media->tracks );
+     }
+
+     printf( "\n%-16s %6s %10s %10s %12s %12s\n", "Codec", "Tracks", "Audio s", "Realtime", "CPU ms/s", "Peak KiB" );
+
+     for (i = 0; i < codec_count; i++) {
+          CodecStats *stats = &codec_stats[i];
+
+          printf( "%-16s %6d %10.2f %10.1f %12.2f %12ld\n", stats->encoding, stats->tracks, stats->audio,
+                  stats->wall ? stats->audio * 1000000 / stats->wall : 0.0,
+                  stats->audio ? stats->cpu / 1000.0 / stats->audio : 0.0, stats->peak_rss );
+     }
+
+     if (codec_stats)
+          D_FREE( codec_stats );
+
+     codec_stats = NULL;
+     codec_count = codec_max = 0;
+}
+
+/******************************************************************************/
+
+static int depth_cb( int length, void *ctx )
+{
+     DepthRun *run      = ctx;
+     int       channels = run->desc.channels;
+     void     *data;
+     long long i, count;
+
+     if (run->buffer->Lock( run->buffer, &data, NULL, NULL ))
+          return 0;
+
+     length = MIN( length, run->desc.length );
+
+     pcm_to_float( data, run->desc.sampleformat, length * channels, run->pcm );
+
+     run->buffer->Unlock( run->buffer );
+
+     run->bytes += length * channels * FS_BYTES_PER_SAMPLE(run->desc.sampleformat);
+
+     /* keep the native output as reference, or null-test against it */
+     count = MAX( MIN( run->reference_frames - run->frames, length ), 0 ) * channels;
+
+     if (run->fill_reference) {
+          memcpy( run->reference + run->frames * channels, run->pcm, count * sizeof(float) );
+     }
+     else {
+          const float *ref = run->reference + run->frames * channels;
+
+          for (i = 0; i < count; i++) {
+               float diff = fabsf( run->pcm[i] - ref[i] );
+
+               run->error_sum += diff * diff;
+               run->error_max  = MAX( run->error_max, diff );
+          }
+
+          run->compared += count;
+     }
+
+     run->frames += length;
+
+     return 0;
+}
+
+static DirectResult depth_decode( IFusionSoundMusicProvider *provider, DepthRun *run, long long *ret_wall,
+                                  long long *ret_cpu )
+{
+     DirectResult          ret;
+     FSMusicProviderStatus status = FMSTATE_UNKNOWN;
+     long long             t0, cpu0;
+
+     ret = sound->CreateBuffer( sound, &run->desc, &run->buffer );
+     if (ret)
+          return ret;
+
+     run->pcm = D_MALLOC( run->desc.length * run->desc.channels * sizeof(float) );
+     if (!run->pcm) {
+          run->buffer->Release( run->buffer );
+          return D_OOM();
+     }
+
+     provider->SeekTo( provider, 0 );
+
+     t0   = direct_clock_get_micros();
+     cpu0 = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID );
+
+     ret = provider->PlayToBuffer( provider, run->buffer, depth_cb, run );
+     if (ret == DR_OK) {
+          while (status != FMSTATE_FINISHED && status != FMSTATE_STOP) {
+               provider->WaitStatus( provider, FMSTATE_FINISHED | FMSTATE_STOP, 0 );
+               provider->GetStatus( provider, &status );
+          }
+
+          provider->Stop( provider );
+     }
+
+     *ret_wall = direct_clock_get_micros() - t0;
+     *ret_cpu  = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID ) - cpu0;
+
+     run->buffer->Release( run->buffer );
+     D_FREE( run->pcm );
+
+     return ret;
+}
+
+static void depth_bench_track( IFusionSoundMusicProvider *provider, Media *media, FSTrackID track_id )
+{
+     FSBufferDescription  bdsc;
+     float               *reference;
+     long long            reference_frames;
+     unsigned int         i;
+
+     if (provider->SelectTrack( provider, track_id ))
+          return;
+
+     provider->GetBufferDescription( provider, &bdsc );
+
+     reference_frames = (long long) bdsc.samplerate * DEPTH_REFERENCE;
+
+     reference = D_CALLOC( reference_frames * bdsc.channels, sizeof(float) );
+     if (!reference) {
+          D_OOM();
+          return;
+     }
+
+     printf( "Track %d.%u (%d Hz, %d channel(s), native %d bit):\n", media->id, track_id, bdsc.samplerate,
+             bdsc.channels, FS_BITS_PER_SAMPLE(bdsc.sampleformat) );
+
+     /* the native format comes first and fills the reference */
+     for (i = 0; i < D_ARRAY_SIZE(depth_stats); i++) {
+          DepthStats *stats = &depth_stats[i];
+          DepthRun    run;
+          long long   wall, cpu;
+          double      audio, residual;
+
+          memset( &run, 0, sizeof(run) );
+
+          run.desc             = bdsc;
+          run.reference        = reference;
+          run.reference_frames = reference_frames;
+          run.fill_reference   = !i;
+
+          if (stats->format != FSSF_UNKNOWN)
+               run.desc.sampleformat = stats->format;
+
+          if (depth_decode( provider, &run, &wall, &cpu )) {
+               fprintf( stderr, "Failed to decode at %d bit!\n", FS_BITS_PER_SAMPLE(run.desc.sampleformat) );
+               continue;
+          }
+
+          audio    = (double) run.frames / bdsc.samplerate;
+          residual = run.compared > 0 ? 10 * log10( run.error_sum / run.compared + 1e-30 ) : -INFINITY;
+
+          if (i)
+               printf( "  %2d bit: CPU %.2f ms per audio second, %.2f MB/s, null test residual %.1f dBFS, "
+                       "max error %.2e\n", FS_BITS_PER_SAMPLE(run.desc.sampleformat), audio ? cpu / 1000.0 / audio : 0.0,
+                       wall ? run.bytes / (double) wall : 0.0, residual, run.error_max );
+          else
+               printf( "  native: CPU %.2f ms per audio second, %.2f MB/s\n", audio ? cpu / 1000.0 / audio : 0.0,
+                       wall ? run.bytes / (double) wall : 0.0 );
+
+          stats->tracks++;
+          stats->audio     += audio;
+          stats->wall      += wall;
+          stats->cpu       += cpu;
+          stats->bytes     += run.bytes;
+          stats->error_sum += run.error_sum;
+          stats->compared  += run.compared;
+          stats->error_max  = MAX( stats->error_max, run.error_max );
+     }
+
+     D_FREE( reference );
+}
+
+static void run_depth_bench()
+{
+     Media        *media;
+     int           t;
+     unsigned int  i;
+
+     for (media = playlist.medias; media < playlist.medias + playlist.count; media++) {
+          IFusionSoundMusicProvider *provider;
+
+          if (sound->CreateMusicProvider( sound, media->mrl, &provider )) {
+               fprintf( stderr, "Failed to create music provider for '%s'!\n", media->mrl );
+               continue;
+          }
+
+          provider->EnumTracks( provider, track_cb, media );
+
+          for (t = 0; t < media->tracks.count; t++)
+               depth_bench_track( provider, media, media->tracks.ids[t] );
+
+          provider->Release( provider );
+
+          track_list_clear( &media->tracks );
+     }
+
+     printf( "\n%-8s %6s %10s %12s %12s %14s %10s\n", "Depth", "Tracks", "Audio s", "CPU ms/s", "+CPU ms/s", "Residual dBFS",
+             "MB/s" );
+
+     for (i = 0; i < D_ARRAY_SIZE(depth_stats); i++) {
+          DepthStats *stats  = &depth_stats[i];
+          double      cpu    = stats->audio ? stats->cpu / 1000.0 / stats->audio : 0.0;
+          double      native = depth_stats[0].audio ? depth_stats[0].cpu / 1000.0 / depth_stats[0].audio : 0.0;
+          char        name[16];
+
+          if (!stats->tracks)
+               continue;
+
+          if (stats->format == FSSF_UNKNOWN)
+               snprintf( name, sizeof(name), "native" );
+          else
+               snprintf( name, sizeof(name), "%d bit", FS_BITS_PER_SAMPLE(stats->format) );
+
+          printf( "%-8s %6d %10.2f %12.2f %12.2f %14.1f %10.2f\n", name, stats->tracks, stats->audio, cpu,
+                  i ? cpu - native : 0.0,
+                  stats->compared ? 10 * log10( stats->error_sum / stats->compared + 1e-30 ) : -INFINITY,
+                  stats->wall ? stats->bytes / (double) stats->wall : 0.0 );
+     }
+}
+
+/******************************************************************************/
+
+static int seek_cb( int length, void *ctx )
+{
+     SeekRun *run = ctx;
+
+     direct_mutex_lock( &run->lock );
+
+     /* the first decoded data after the seek */
+     if (run->pending) {
+          run->latency = direct_clock_get_micros() - run->seek_time;
+          run->frames  = 0;
+          run->pending = 0;
+
+          direct_waitqueue_broadcast( &run->cond );
+     }
+
+     run->frames += length;
+
+     direct_mutex_unlock( &run->lock );
+
+     return 0;
+}
+
+static SeekStats *lookup_seek_stats( const char *encoding )
+{
+     int i;
+
+     for (i = 0; i < seek_codec_count; i++) {
+          if (!strcmp( seek_stats[i].encoding, encoding ))
+               return &seek_stats[i];
+     }
+
+     if (seek_codec_count == seek_codec_max) {
+          int        max   = seek_codec_max ? seek_codec_max * 2 : 16;
+          SeekStats *stats = D_REALLOC( seek_stats, max * sizeof(SeekStats) );
+
+          if (!stats) {
+               D_OOM();
+               return NULL;
+          }
+
+          seek_stats     = stats;
+          seek_codec_max = max;
+     }
+
+     memset( &seek_stats[seek_codec_count], 0, sizeof(SeekStats) );
+
+     snprintf( seek_stats[seek_codec_count].encoding, sizeof(seek_stats[seek_codec_count].encoding), "%s", encoding );
+
+     return &seek_stats[seek_codec_count++];
+}
+
+static void seek_stats_add( SeekStats *stats, double latency, double error )
+{
+     if (stats->count == stats->max) {
+          int     max       = stats->max ? stats->max * 2 : 256;
+          double *latencies = D_REALLOC( stats->latency, max * sizeof(double) );
+          double *errors    = latencies ? D_REALLOC( stats->error, max * sizeof(double) ) : NULL;
+
+          if (latencies)
+               stats->latency = latencies;
+
+          if (!errors) {
+               D_OOM();
+               return;
+          }
+
+          stats->error = errors;
+          stats->max   = max;
+     }
+
+     stats->latency[stats->count] = latency;
+     stats->error[stats->count]   = error;
+     stats->count++;
+}
+
+static int compare_double( const void *a, const void *b )
+{
+     double x = *(const double*) a;
+     double y = *(const double*) b;
+
+     return (x > y) - (x < y);
+}
+
+static double percentile( const double *sorted, int count, int percent )
+{
+     return sorted[MIN( count * percent / 100, count - 1 )];
+}
+
+static void seek_bench_track( IFusionSoundMusicProvider *provider, Media *media, FSTrackID track_id )
+{
+     DirectResult                ret;
+     FSTrackDescription          desc;
+     FSBufferDescription         bdsc;
+     FSMusicProviderCapabilities caps;
+     SeekRun                     run;
+     SeekStats                  *stats;
+     double                      len = 0;
+     double                      latency_sum = 0, error_sum = 0;
+     int                         done = 0;
+     int                         stride, a, b;
+     int                         i;
+
+     if (provider->SelectTrack( provider, track_id ))
+          return;
+
+     provider->GetCapabilities( provider, &caps );
+     provider->GetTrackDescription( provider, &desc );
+     provider->GetBufferDescription( provider, &bdsc );
+     provider->GetLength( provider, &len );
+
+     if (!(caps & FMCAPS_SEEK) || len <= 0) {
+          printf( "Track %d.%u: not seekable\n", media->id, track_id );
+          return;
+     }
+
+     memset( &run, 0, sizeof(run) );
+
+     ret = sound->CreateBuffer( sound, &bdsc, &run.buffer );
+     if (ret) {
+          FusionSoundError( "CreateBuffer failed", ret );
+          return;
+     }
+
+     direct_mutex_init( &run.lock );
+     direct_waitqueue_init( &run.cond );
+
+     stats = lookup_seek_stats( *desc.encoding ? desc.encoding : "Unknown" );
+
+     /* keep decoding across the end of the track */
+     provider->SetPlaybackFlags( provider, FMPLAY_LOOPING );
+
+     /* evenly spread positions, visited with a stride coprime to their number to jump back and forth */
+     for (stride = seek_bench * 5 / 8 + 1;; stride++) {
+          for (a = stride, b = seek_bench; b;) {
+               int t = a % b;
+               a = b;
+               b = t;
+          }
+
+          if (a == 1)
+               break;
+     }
+
+     for (i = 0; i < seek_bench; i++) {
+          double    target, pos = 0;
+          long long frames, latency;
+          int       timeout;
+
+          target = len * ((long long) i * stride % seek_bench + 0.5) / seek_bench;
+
+          /* seek while decoding */
+          ret = provider->PlayToBuffer( provider, run.buffer, seek_cb, &run );
+          if (ret) {
+               FusionSoundError( "PlayToBuffer failed", ret );
+               break;
+          }
+
+          direct_mutex_lock( &run.lock );
+          run.seek_time = direct_clock_get_micros();
+          direct_mutex_unlock( &run.lock );
+
+          if (provider->SeekTo( provider, target )) {
+               provider->Stop( provider );
+               continue;
+          }
+
+          /* data delivered after SeekTo() returned is decoded from the new position */
+          direct_mutex_lock( &run.lock );
+
+          run.pending = 1;
+
+          while (run.pending) {
+               if (direct_waitqueue_wait_timeout( &run.cond, &run.lock, 1000000 ) == DR_TIMEOUT)
+                    break;
+          }
+
+          timeout     = run.pending;
+          latency     = run.latency;
+          run.pending = 0;
+
+          direct_mutex_unlock( &run.lock );
+
+          /* stop decoding so that the position and the frames delivered since the seek belong together */
+          provider->Stop( provider );
+
+          if (timeout)
+               continue;
+
+          provider->GetPos( provider, &pos );
+
+          direct_mutex_lock( &run.lock );
+          frames = run.frames;
+          direct_mutex_unlock( &run.lock );
+
+          /* the position of the first decoded data after the seek, minus the requested position */
+          pos -= (double) frames / bdsc.samplerate;
+
+          if (stats)
+               seek_stats_add( stats, latency / 1000.0, (pos - target) * 1000 );
+
+          latency_sum += latency / 1000.0;
+          error_sum   += fabs( pos - target ) * 1000;
+          done++;
+     }
+
+     printf( "Track %d.%u (%s): %d seeks, average latency %.2f ms, average error %.1f ms\n", media->id, track_id,
+             *desc.encoding ? desc.encoding : "Unknown", done, done ? latency_sum / done : 0.0,
+             done ? error_sum / done : 0.0 );
+
+     provider->SetPlaybackFlags( provider, FMPLAY_NOFX );
+
+     direct_waitqueue_deinit( &run.cond );
+     direct_mutex_deinit( &run.lock );
+
+     run.buffer->Release( run.buffer );
+}
+
+static void run_seek_bench()
+{
+     Media *media;
+     int    i, j, t;
+
+     for (media = playlist.medias; media < playlist.medias + playlist.count; media++) {
+          IFusionSoundMusicProvider *provider;
+
+          if (sound->CreateMusicProvider( sound, media->mrl, &provider )) {
+               fprintf( stderr, "Failed to create music provider for '%s'!\n", media->mrl );
+               continue;
+          }
+
+          provider->EnumTracks( provider, track_cb, media );
+
+          for (t = 0; t < media->tracks.count; t++)
+               seek_bench_track( provider, media, media->tracks.ids[t] );
+
+          provider->Release( provider );
+
+          track_list_clear( &media->tracks );
+     }
+
+     printf( "\n%-16s %6s %27s %33s\n", "", "", "Latency ms", "Error ms (absolute)" );
+     printf( "%-16s %6s %8s %8s %8s %8s %8s %8s %8s %8s\n", "Codec", "Seeks", "p50", "p90", "p99", "max",
+             "p50", "p90", "p99", "max" );
+
+     for (i = 0; i < seek_codec_count; i++) {
+          SeekStats *stats = &seek_stats[i];
+
+          if (!stats->count)
+               continue;
+
+          for (j = 0; j < stats->count; j++)
+               stats->error[j] = fabs( stats->error[j] );
+
+          qsort( stats->latency, stats->count, sizeof(double), compare_double );
+          qsort( stats->error, stats->count, sizeof(double), compare_double );
+
+          printf( "%-16s %6d %8.2f %8.2f %8.2f %8.2f %8.1f %8.1f %8.1f %8.1f\n", stats->encoding, stats->count,
+                  percentile( stats->latency, stats->count, 50 ), percentile( stats->latency, stats->count, 90 ),
+                  percentile( stats->latency, stats->count, 99 ), stats->latency[stats->count - 1],
+                  percentile( stats->error, stats->count, 50 ), percentile( stats->error, stats->count, 90 ),
+                  percentile( stats->error, stats->count, 99 ), stats->error[stats->count - 1] );
+
+          D_FREE( stats->latency );
+          D_FREE( stats->error );
+     }
+
+     if (seek_stats)
+          D_FREE( seek_stats );
+
+     seek_stats       = NULL;
+     seek_codec_count = seek_codec_max = 0;
+}
+
+/******************************************************************************/
+
+static void mix_voice_release( MixVoice *voice )
+{
+     if (voice->provider) {
+          voice->provider->Stop( voice->provider );
+          voice->provider->Release( voice->provider );
+     }
+
+     if (voice->stream)
+          voice->stream->Release( voice->stream );
+
+     memset( voice, 0, sizeof(MixVoice) );
+}
+
+static DirectResult mix_voice_open( MixVoice *voice, Media *media )
+{
+     DirectResult        ret;
+     FSStreamDescription desc;
+
+     ret = sound->CreateMusicProvider( sound, media->mrl, &voice->provider );
+     if (ret)
+          return ret;
+
+     voice->provider->GetStreamDescription( voice->provider, &desc );
+
+     if (sampleformat != FSSF_UNKNOWN)
+          desc.sampleformat = sampleformat;
+
+     if (buffersize) {
+          desc.flags      |= FSSDF_BUFFERSIZE;
+          desc.buffersize  = buffersize;
+     }
+
+     if (prebuffer) {
+          desc.flags     |= FSSDF_PREBUFFER;
+          desc.prebuffer  = prebuffer;
+     }
+
+     ret = sound->CreateStream( sound, &desc, &voice->stream );
+     if (ret) {
+          mix_voice_release( voice );
+          return ret;
+     }
+
+     /* loop so that every stream stays active during the whole window */
+     voice->provider->SetPlaybackFlags( voice->provider, FMPLAY_LOOPING );
+
+     ret = voice->provider->PlayToStream( voice->provider, voice->stream );
+     if (ret)
+          mix_voice_release( voice );
+
+     return ret;
+}
+
+static void run_mix()
+{
+     MixVoice *voices;
+     Media    *media  = playlist.medias;
+     int       glitch = 0;
+     int       tested = 0;
+     int       count, i;
+
+     voices = D_CALLOC( mix, sizeof(MixVoice) );
+     if (!voices) {
+          D_OOM();
+          return;
+     }
+
+     printf( "%7s %10s %12s %10s %14s %14s\n", "Streams", "CPU %", "CPU %/stream", "Underruns", "Latency avg ms",
+             "Latency max ms" );
+
+     /* double the number of simultaneous streams up to the maximum */
+     for (count = 1; tested < mix; count = MIN( count * 2, mix )) {
+          long long t0, cpu0, wall, cpu;
+          long long latency_sum = 0;
+          int       latency_max = 0;
+          int       samples     = 0;
+          int       underruns   = 0;
+
+          /* keep the streams of the previous step and add the missing ones */
+          for (i = 0; i < count; i++) {
+               if (voices[i].provider)
+                    continue;
+
+               if (mix_voice_open( &voices[i], media )) {
+                    fprintf( stderr, "Failed to open stream %d for '%s'!\n", i + 1, media->mrl );
+                    break;
+               }
+
+               media = playlist_media( media->id + 1 ) ?: playlist.medias;
+          }
+
+          if (i < count)
+               break;
+
+          for (i = 0; i < count; i++)
+               voices[i].underruns = voices[i].in_underrun = 0;
+
+          t0   = direct_clock_get_micros();
+          cpu0 = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID );
+
+          while (direct_clock_get_micros() - t0 < MIX_WINDOW * 1000LL) {
+               for (i = 0; i < count; i++) {
+                    MixVoice *voice  = &voices[i];
+                    int       filled  = 0;
+                    int       total   = 0;
+                    int       read    = 0;
+                    int       write   = 0;
+                    int       delay   = 0;
+                    bool      playing = false;
+
+                    voice->stream->GetStatus( voice->stream, &filled, &total, &read, &write, &playing );
+                    voice->stream->GetPresentationDelay( voice->stream, &delay );
+
+                    /* an empty ring buffer while looping is an underrun once the stream has been prebuffered */
+                    if (filled)
+                         voice->was_filled = 1;
+                    else if (voice->was_filled && !voice->in_underrun)
+                         voice->underruns++;
+
+                    voice->in_underrun = voice->was_filled && !filled;
+
+                    latency_sum += delay;
+                    latency_max  = MAX( latency_max, delay );
+                    samples++;
+               }
+
+               usleep( TELEMETRY_INTERVAL * 1000 );
+          }
+
+          wall = direct_clock_get_micros() - t0;
+          cpu  = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID ) - cpu0;
+
+          for (i = 0; i < count; i++)
+               underruns += voices[i].underruns;
+
+          if (underruns && !glitch)
+               glitch = count;
+
+          tested = count;
+
+          printf( "%7d %10.2f %12.2f %10d %14.1f %14d\n", count, cpu * 100.0 / wall, cpu * 100.0 / wall / count,
+                  underruns, samples ? (double) latency_sum / samples : 0.0, latency_max );
+          fflush( stdout );
+     }
+
+     for (i = 0; i < mix; i++)
+          mix_voice_release( &voices[i] );
+
+     D_FREE( voices );
+
+     if (glitch)
+          printf( "\nFirst underruns with %d simultaneous streams.\n", glitch );
+     else
+          printf( "\nNo underruns up to %d simultaneous streams.\n", tested );
+}
+
+/******************************************************************************/
+
+static void *telemetry_thread( DirectThread *thread, void *arg )
+{
+     int in_underrun = 0;
+     int in_low      = 0;
+
+     direct_mutex_lock( &telemetry.lock );
+
+     while (!telemetry.stop) {
+          int                   filled = 0;
+          int                   total  = 0;
+          int                   read   = 0;
+          int                   write  = 0;
+          bool                  playing = false;
+          FSMusicProviderStatus status = FMSTATE_UNKNOWN;
+          long long             time;
+
+          stream->GetStatus( stream, &filled, &total, &read, &write, &playing );
+
+          telemetry.provider->GetStatus( telemetry.provider, &status );
+
+          time = direct_clock_get_micros() - telemetry.start;
+
+          if (total > 0) {
+               int percent = filled * 100 / total;
+
+               telemetry.samples++;
+               telemetry.total = total;
+               telemetry.histogram[MIN( percent * TELEMETRY_BINS / 100, TELEMETRY_BINS - 1 )]++;
+
+               if (telemetry.samples == 1 || filled < telemetry.min_filled)
+                    telemetry.min_filled = filled;
+
+               /* only an empty ring buffer while the provider is still decoding is an underrun */
+               if (status == FMSTATE_PLAY) {
+                    if (!filled) {
+                         if (!in_underrun)
+                              telemetry.underruns++;
+                    }
+                    else if (percent < TELEMETRY_LOW) {
+                         if (!in_low)
+                              telemetry.near_underruns++;
+                    }
+
+                    in_underrun = !filled;
+                    in_low      = filled && percent < TELEMETRY_LOW;
+               }
+               else
+                    in_underrun = in_low = 0;
+          }
+
+          if (telemetry.file)
+               fprintf( telemetry.file, "%lld.%03lld,%d,%d,%d,%d,%d,%d\n", time / 1000, time % 1000,
+                        filled, total, read, write, playing, status );
+
+          direct_waitqueue_wait_timeout( &telemetry.cond, &telemetry.lock, telemetry_interval );
+     }
+
+     direct_mutex_unlock( &telemetry.lock );
+
+     return NULL;
+}
+
+static void telemetry_start( IFusionSoundMusicProvider *provider, Media *media, FSTrackID track_id )
+{
+     char filename[1024];
+
+     memset( &telemetry, 0, sizeof(telemetry) );
+
+     if (telemetry_prefix) {
+          snprintf( filename, sizeof(filename), "%s%d.%u.csv", telemetry_prefix, media->id, track_id );
+
+          telemetry.file = fopen( filename, "w" );
+          if (!telemetry.file)
+               fprintf( stderr, "Failed to open telemetry file '%s'!\n", filename );
+          else
+               fprintf( telemetry.file, "# %s, track %u\n"
+                        "# time_ms,filled,total,read_position,write_position,playing,status\n", media->mrl, track_id );
+     }
+
+     telemetry.provider = provider;
+     telemetry.start    = direct_clock_get_micros();
+
+     direct_mutex_init( &telemetry.lock );
+     direct_waitqueue_init( &telemetry.cond );
+
+     telemetry.thread = direct_thread_create( DTT_DEFAULT, telemetry_thread, NULL, "Telemetry" );
+}
+
+static void telemetry_stop()
+{
+     int i;
+
+     if (!telemetry.thread)
+          return;
+
+     direct_mutex_lock( &telemetry.lock );
+     telemetry.stop = 1;
+     direct_waitqueue_broadcast( &telemetry.cond );
+     direct_mutex_unlock( &telemetry.lock );
+
+     direct_thread_join( telemetry.thread );
+     direct_thread_destroy( telemetry.thread );
+     telemetry.thread = NULL;
+
+     direct_waitqueue_deinit( &telemetry.cond );
+     direct_mutex_deinit( &telemetry.lock );
+
+     if (telemetry.file) {
+          fprintf( telemetry.file, "# samples %d, underruns %d, near-underruns %d (<%d%%), min filled %d of %d\n",
+                   telemetry.samples, telemetry.underruns, telemetry.near_underruns, TELEMETRY_LOW,
+                   telemetry.min_filled, telemetry.total );
+          fprintf( telemetry.file, "# histogram" );
+          for (i = 0; i < TELEMETRY_BINS; i++)
+               fprintf( telemetry.file, " %d-%d%%:%d", i * 100 / TELEMETRY_BINS, (i + 1) * 100 / TELEMETRY_BINS,
+                        telemetry.histogram[i] );
+          fprintf( telemetry.file, "\n" );
+
+          fclose( telemetry.file );
+          telemetry.file = NULL;
+     }
+
+     if (!quiet && telemetry_prefix)
+          fprintf( stderr, "Telemetry: %d samples, %d underruns, %d near-underruns, min filled %d of %d frames\n",
+                   telemetry.samples, telemetry.underruns, telemetry.near_underruns, telemetry.min_filled,
+                   telemetry.total );
+}
+
+/******************************************************************************/
+
+static long long timeval_micros( const struct timeval *tv )
+{
+     return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+/* read user and system time of all threads of the process from /proc/self/task */
+static int account_threads( ThreadSample *threads, int max )
+{
+     DIR           *dir;
+     struct dirent *entry;
+     int            count = 0;
+
+     dir = opendir( "/proc/self/task" );
+     if (!dir)
+          return 0;
+
+     while ((entry = readdir( dir )) != NULL && count < max) {
+          char                buf[512];
+          char                path[sizeof("/proc/self/task//stat") + sizeof(entry->d_name)];
+          char               *name, *end;
+          FILE               *f;
+          unsigned long long  utime, stime;
+
+          if (entry->d_name[0] == '.')
+               continue;
+
+          snprintf( path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name );
+
+          f = fopen( path, "r" );
+          if (!f)
+               continue;
+
+          if (!fgets( buf, sizeof(buf), f )) {
+               fclose( f );
+               continue;
+          }
+
+          fclose( f );
+
+          /* the thread name is in parentheses and may contain any character */
+          name = strchr( buf, '(' );
+          end  = strrchr( buf, ')' );
+          if (!name || !end || end < name)
+               continue;
+
+          if (sscanf( end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime ) != 2)
+               continue;
+
+          *end = 0;
+
+          threads[count].tid   = atoi( buf );
+          threads[count].ticks = utime + stime;
+          snprintf( threads[count].name, sizeof(threads[count].name), "%s", name + 1 );
+
+          count++;
+     }
+
+     /* more threads than a sample holds */
+     if (entry && count == max) {
+          static int warned = 0;
+
+          if (!warned++)
+               fprintf( stderr, "Accounting: more than %d threads, the others are not counted!\n", max );
+     }
+
+     closedir( dir );
+
+     return count;
+}
+
+static void account_sample( AccountSample *sample )
+{
+     sample->time = direct_clock_get_micros();
+
+     getrusage( RUSAGE_SELF, &sample->usage );
+
+     sample->rss         = current_rss();
+     sample->num_threads = account_threads( sample->threads, ACCOUNT_THREADS );
+}
+
+static AccountStats *lookup_account_stats( const char *encoding )
+{
+     int i;
+
+     for (i = 0; i < account_count; i++) {
+          if (!strcmp( account_stats[i].encoding, encoding ))
+               return &account_stats[i];
+     }
+
+     if (account_count == account_max) {
+          int           max   = account_max ? account_max * 2 : 16;
+          AccountStats *stats = D_REALLOC( account_stats, max * sizeof(AccountStats) );
+
+          if (!stats) {
+               D_OOM();
+               return NULL;
+          }
+
+          account_stats = stats;
+          account_max   = max;
+     }
+
+     memset( &account_stats[account_count], 0, sizeof(AccountStats) );
+
+     snprintf( account_stats[account_count].encoding, sizeof(account_stats[account_count].encoding), "%s", encoding );
+
+     return &account_stats[account_count++];
+}
+
+static ThreadTotal *lookup_thread_total( ThreadTotal **totals, int *count, int *max, const char *name )
+{
+     int i;
+
+     for (i = 0; i < *count; i++) {
+          if (!strcmp( (*totals)[i].name, name ))
+               return &(*totals)[i];
+     }
+
+     if (*count == *max) {
+          int          new_max    = *max ? *max * 2 : 32;
+          ThreadTotal *new_totals = D_REALLOC( *totals, new_max * sizeof(ThreadTotal) );
+
+          if (!new_totals) {
+               D_OOM();
+               return NULL;
+          }
+
+          *totals = new_totals;
+          *max    = new_max;
+     }
+
+     snprintf( (*totals)[*count].name, sizeof((*totals)[*count].name), "%s", name );
+     (*totals)[*count].ticks = 0;
+
+     return &(*totals)[(*count)++];
+}
+
+static void account_begin()
+{
+     account_sample( &account_begin_sample );
+}
+
+static void account_end( const char *encoding )
+{
+     AccountSample *begin = &account_begin_sample;
+     AccountSample  end;
+     AccountStats  *stats;
+     ThreadTotal   *track_threads = NULL;
+     int            track_count   = 0;
+     int            track_max     = 0;
+     long           ticks       = sysconf( _SC_CLK_TCK );
+     long long      wall, user, system;
+     long           vcsw, ivcsw, rss;
+     int            i, j;
+
+     account_sample( &end );
+
+     wall   = end.time - begin->time;
+     user   = timeval_micros( &end.usage.ru_utime ) - timeval_micros( &begin->usage.ru_utime );
+     system = timeval_micros( &end.usage.ru_stime ) - timeval_micros( &begin->usage.ru_stime );
+     vcsw   = end.usage.ru_nvcsw  - begin->usage.ru_nvcsw;
+     ivcsw  = end.usage.ru_nivcsw - begin->usage.ru_nivcsw;
+     rss    = end.rss - begin->rss;
+
+     /* threads are matched by id, threads started during the track count from zero,
+        threads which ended during the track are lost */
+     for (i = 0; i < end.num_threads; i++) {
+          ThreadSample *thread = &end.threads[i];
+          ThreadTotal  *total;
+          long long     delta  = thread->ticks;
+
+          for (j = 0; j < begin->num_threads; j++) {
+               if (begin->threads[j].tid == thread->tid) {
+                    delta -= begin->threads[j].ticks;
+                    break;
+               }
+          }
+
+          if (delta <= 0)
+               continue;
+
+          total = lookup_thread_total( &track_threads, &track_count, &track_max, thread->name );
+          if (total)
+               total->ticks += delta;
+
+          total = lookup_thread_total( &thread_totals, &thread_count, &thread_max, thread->name );
+          if (total)
+               total->ticks += delta;
+     }
+
+     stats = lookup_account_stats( *encoding ? encoding : "Unknown" );
+     if (stats) {
+          stats->tracks++;
+          stats->wall      += wall;
+          stats->user      += user;
+          stats->system    += system;
+          stats->vcsw      += vcsw;
+          stats->ivcsw     += ivcsw;
+          stats->rss_delta += rss;
+          stats->rss_max    = MAX( stats->rss_max, rss );
+     }
+
+     if (!quiet) {
+          fprintf( stderr, "Accounting: user %lld ms, system %lld ms in %lld ms, context switches %ld voluntary, "
+                   "%ld involuntary, RSS %+ld KiB\n", user / 1000, system / 1000, wall / 1000, vcsw, ivcsw, rss );
+
+          if (track_count) {
+               fprintf( stderr, "  Threads:" );
+               for (i = 0; i < track_count; i++)
+                    fprintf( stderr, " %s %lld ms%s", track_threads[i].name, track_threads[i].ticks * 1000 / ticks,
+                             i < track_count - 1 ? "," : "\n" );
+          }
+     }
+
+     if (track_threads)
+          D_FREE( track_threads );
+}
+
+static void account_free()
+{
+     if (account_stats)
+          D_FREE( account_stats );
+
+     if (thread_totals)
+          D_FREE( thread_totals );
+
+     account_stats = NULL;
+     thread_totals = NULL;
+     account_count = account_max = thread_count = thread_max = 0;
+}
+
+static void print_account_stats()
+{
+     long ticks = sysconf( _SC_CLK_TCK );
+     int  i;
+
+     if (!account_count)
+          return;
+
+     fprintf( stderr, "\n%-16s %6s %8s %9s %9s %7s %9s %9s %9s %9s\n", "Codec", "Tracks", "Wall s",
+              "User ms/s", "Sys ms/s", "CPU %", "Vcsw/s", "Ivcsw/s", "RSS KiB", "Max KiB" );
+
+     for (i = 0; i < account_count; i++) {
+          AccountStats *stats   = &account_stats[i];
+          double        seconds = stats->wall / 1000000.0;
+
+          if (!seconds)
+               continue;
+
+          fprintf( stderr, "%-16s %6d %8.1f %9.2f %9.2f %7.2f %9.1f %9.1f %+9ld %+9ld\n", stats->encoding,
+                   stats->tracks, seconds, stats->user / 1000.0 / seconds, stats->system / 1000.0 / seconds,
+                   (stats->user + stats->system) / 10000.0 / seconds, stats->vcsw / seconds, stats->ivcsw / seconds,
+                   stats->rss_delta / stats->tracks, stats->rss_max );
+     }
+
+     if (thread_count) {
+          fprintf( stderr, "\n%-16s %9s\n", "Thread", "CPU ms" );
+
+          for (i = 0; i < thread_count; i++)
+               fprintf( stderr, "%-16s %9lld\n", thread_totals[i].name, thread_totals[i].ticks * 1000 / ticks );
+     }
+}
+
+/******************************************************************************/
+
+static void prefetch_entry_free( PrefetchEntry *entry )
+{
+     if (entry->provider)
+          entry->provider->Release( entry->provider );
+
+     track_list_clear( &entry->tracks );
+
+     D_FREE( entry );
+}
+
+static void *prefetch_thread( DirectThread *thread, void *arg )
+{
+     direct_mutex_lock( &prefetcher.lock );
+
+     while (!prefetcher.stop) {
+          PrefetchEntry             *entry;
+          IFusionSoundMusicProvider *provider;
+          Media                      tmp;
+          long long                  t0;
+          DirectResult               ret;
+
+          direct_list_foreach (entry, prefetcher.entries) {
+               if (entry->state == PREFETCH_WANTED)
+                    break;
+          }
+
+          if (!entry) {
+               direct_waitqueue_wait( &prefetcher.cond, &prefetcher.lock );
+               continue;
+          }
+
+          entry->state = PREFETCH_OPENING;
+
+          direct_mutex_unlock( &prefetcher.lock );
+
+          /* open and enumerate the media, collecting the tracks in a temporary media struct */
+          memset( &tmp, 0, sizeof(tmp) );
+
+          t0 = direct_clock_get_micros();
+
+          ret = sound->CreateMusicProvider( sound, entry->media->mrl, &provider );
+          if (ret == DR_OK) {
+               if (index_fill_tracks( entry->media, &tmp.tracks ) == DR_OK)
+                    ret = DR_OK;
+               else
+                    ret = provider->EnumTracks( provider, track_cb, &tmp );
+               if (ret) {
+                    provider->Release( provider );
+                    provider = NULL;
+               }
+          }
+          else
+               provider = NULL;
+
+          direct_mutex_lock( &prefetcher.lock );
+
+          entry->provider = provider;
+          entry->tracks   = tmp.tracks;
+          entry->time     = direct_clock_get_micros() - t0;
+          entry->state    = ret ? PREFETCH_FAILED : PREFETCH_READY;
+
+          /* the media went out of the prefetch window while being opened */
+          if (entry->discard) {
+               direct_list_remove( &prefetcher.entries, &entry->link );
+               prefetch_entry_free( entry );
+          }
+
+          direct_waitqueue_broadcast( &prefetcher.cond );
+     }
+
+     direct_mutex_unlock( &prefetcher.lock );
+
+     return NULL;
+}
+
+static void prefetch_init()
+{
+     direct_mutex_init( &prefetcher.lock );
+     direct_waitqueue_init( &prefetcher.cond );
+
+     prefetcher.thread = direct_thread_create( DTT_DEFAULT, prefetch_thread, NULL, "Prefetch" );
+}
+
+static void prefetch_shutdown()
+{
+     PrefetchEntry *entry, *entry_next;
+
+     if (!prefetcher.thread)
+          return;
+
+     direct_mutex_lock( &prefetcher.lock );
+     prefetcher.stop = 1;
+     direct_waitqueue_broadcast( &prefetcher.cond );
+     direct_mutex_unlock( &prefetcher.lock );
+
+     direct_thread_join( prefetcher.thread );
+     direct_thread_destroy( prefetcher.thread );
+     prefetcher.thread = NULL;
+
+     direct_list_foreach_safe (entry, entry_next, prefetcher.entries) {
+          prefetch_entry_free( entry );
+     }
+
+     prefetcher.entries = NULL;
+
+     direct_waitqueue_deinit( &prefetcher.cond );
+     direct_mutex_deinit( &prefetcher.lock );
+}
+
+/* set the prefetch window to the next medias after the current one in playback direction */
+static void prefetch_update( Media *current, int dir, int repeat )
+{
+     PrefetchEntry *entry, *entry_next;
+     Media         *wanted[prefetch];
+     Media         *media = current;
+     int            count = 0;
+     int            i, j;
+
+     /* the next medias in shuffle order, the current one again if another of its tracks follows */
+     for (i = 1; shuffle && count < prefetch && i < shuffle_order.count; i++) {
+          ShuffleEntry *entries = shuffle_order.entries;
+          int           pos     = shuffle_order.pos + i * dir;
+
+          /* across the end of the pass in repeat mode, backwards within the same pass as in shuffle_step() */
+          if (pos < 0 || pos >= shuffle_order.count) {
+               if (!repeat)
+                    break;
+
+               if (pos >= shuffle_order.count) {
+                    entries  = shuffle_order.next;
+                    pos     -= shuffle_order.count;
+               }
+               else
+                    pos += shuffle_order.count;
+          }
+
+          media = entries[pos].media;
+
+          for (j = 0; j < count; j++) {
+               if (wanted[j] == media)
+                    break;
+          }
+
+          if (j == count)
+               wanted[count++] = media;
+     }
+
+     while (!shuffle && count < prefetch) {
+          int index = media->id + dir;
+
+          /* wrap around at either end in repeat mode */
+          if (repeat)
+               index = (index + playlist.count) % playlist.count;
+
+          media = playlist_media( index );
+
+          if (!media || media == current)
+               break;
+
+          wanted[count++] = media;
+     }
+
+     direct_mutex_lock( &prefetcher.lock );
+
+     /* drop medias out of the window */
+     direct_list_foreach_safe (entry, entry_next, prefetcher.entries) {
+          for (i = 0; i < count; i++) {
+               if (wanted[i] == entry->media)
+                    break;
+          }
+
+          if (i < count)
+               continue;
+
+          if (entry->state == PREFETCH_OPENING) {
+               entry->discard = 1;
+          }
+          else {
+               direct_list_remove( &prefetcher.entries, &entry->link );
+               prefetch_entry_free( entry );
+          }
+     }
+
+     /* add new medias to the window */
+     for (i = 0; i < count; i++) {
+          direct_list_foreach (entry, prefetcher.entries) {
+               if (entry->media == wanted[i] && !entry->discard)
+                    break;
+          }
+
+          if (entry)
+               continue;
+
+          entry = D_CALLOC( 1, sizeof(PrefetchEntry) );
+          if (!entry) {
+               D_OOM();
+               break;
+          }
+
+          entry->media = wanted[i];
+
+          direct_list_append( &prefetcher.entries, &entry->link );
+     }
+
+     direct_waitqueue_broadcast( &prefetcher.cond );
+
+     direct_mutex_unlock( &prefetcher.lock );
+}
+
+/* take the music provider of a prefetched media, waiting if it is being opened */
+static IFusionSoundMusicProvider *prefetch_take( Media *media, long long *ret_time )
+{
+     PrefetchEntry             *entry;
+     IFusionSoundMusicProvider *provider = NULL;
+
+     direct_mutex_lock( &prefetcher.lock );
+
+     while (1) {
+          direct_list_foreach (entry, prefetcher.entries) {
+               if (entry->media == media && !entry->discard)
+                    break;
+          }
+
+          if (!entry || entry->state != PREFETCH_OPENING)
+               break;
+
+          direct_waitqueue_wait( &prefetcher.cond, &prefetcher.lock );
+     }
+
+     if (entry && entry->state == PREFETCH_READY) {
+          provider  = entry->provider;
+          *ret_time = entry->time;
+
+          media->tracks = entry->tracks;
+
+          entry->provider = NULL;
+
+          memset( &entry->tracks, 0, sizeof(TrackList) );
+     }
+
+     if (entry) {
+          direct_list_remove( &prefetcher.entries, &entry->link );
+          prefetch_entry_free( entry );
+     }
+
+     direct_mutex_unlock( &prefetcher.lock );
+
+     return provider;
+}
+
+static void print_prefetch_stats()
+{
+     fprintf( stderr, "Prefetch: %d media switches prefetched, average latency %.3f ms (%.3f ms saved each), "
+              "%d opened on demand, average latency %.3f ms\n",
+              prefetcher.hits, prefetcher.hits ? prefetcher.hit_latency / 1000.0 / prefetcher.hits : 0.0,
+              prefetcher.hits ? prefetcher.saved / 1000.0 / prefetcher.hits : 0.0,
+              prefetcher.misses, prefetcher.misses ? prefetcher.miss_latency / 1000.0 / prefetcher.misses : 0.0 );
+}
+
+/******************************************************************************/
+
+/* splitmix64, the same seed gives the same order everywhere */
+static u64 shuffle_random()
+{
+     u64 z = (shuffle_order.state += 0x9e3779b97f4a7c15ULL);
+
+     z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+     z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+     return z ^ (z >> 31);
+}
+
+/* Fisher-Yates shuffle, a new pass does not start with the last pair of the previous one */
+static void shuffle_permute( ShuffleEntry *entries, const ShuffleEntry *last )
+{
+     ShuffleEntry tmp;
+     int          i, j;
+
+     for (i = shuffle_order.count - 1; i > 0; i--) {
+          j = shuffle_random() % (i + 1);
+
+          tmp        = entries[i];
+          entries[i] = entries[j];
+          entries[j] = tmp;
+     }
+
+     if (last && shuffle_order.count > 1 && entries[0].media == last->media && entries[0].id == last->id) {
+          j = 1 + shuffle_random() % (shuffle_order.count - 1);
+
+          tmp        = entries[0];
+          entries[0] = entries[j];
+          entries[j] = tmp;
+     }
+}
+
+/* the next pass starts from the current permutation, as if it was permuted again at its end */
+static void shuffle_permute_next()
+{
+     memcpy( shuffle_order.next, shuffle_order.entries, shuffle_order.count * sizeof(ShuffleEntry) );
+
+     shuffle_permute( shuffle_order.next, &shuffle_order.entries[shuffle_order.count - 1] );
+}
+
+/* a media opened for enumeration is not kept in the page cache, so that switch latencies stay comparable with the
+   sequential mode, which does not open medias ahead of playback */
+static void shuffle_drop_cache( const char *mrl )
+{
+     int fd;
+
+     if (strstr( mrl, "://" ))
+          return;
+
+     fd = open( mrl, O_RDONLY );
+     if (fd < 0)
+          return;
+
+     posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+
+     close( fd );
+}
+
+/* collect all (media, track) pairs, from the index if up to date */
+static DirectResult shuffle_init()
+{
+     Media     *media;
+     long long  t0 = direct_clock_get_micros();
+     int        max = 0;
+
+     for (media = playlist.medias; media < playlist.medias + playlist.count; media++) {
+          Media tmp;
+          int   t;
+
+          memset( &tmp, 0, sizeof(tmp) );
+
+          if (index_fill_tracks( media, &tmp.tracks ) != DR_OK) {
+               IFusionSoundMusicProvider *provider;
+
+               if (sound->CreateMusicProvider( sound, media->mrl, &provider ))
+                    continue;
+
+               provider->EnumTracks( provider, track_cb, &tmp );
+               provider->Release( provider );
+
+               shuffle_drop_cache( media->mrl );
+
+               shuffle_order.probed++;
+          }
+
+          for (t = 0; t < tmp.tracks.count; t++) {
+               if (shuffle_order.count == max) {
+                    ShuffleEntry *entries;
+
+                    max     = MAX( max * 2, 64 );
+                    entries = D_REALLOC( shuffle_order.entries, max * sizeof(ShuffleEntry) );
+                    if (!entries) {
+                         track_list_clear( &tmp.tracks );
+                         return D_OOM();
+                    }
+
+                    shuffle_order.entries = entries;
+               }
+
+               shuffle_order.entries[shuffle_order.count].media = media;
+               shuffle_order.entries[shuffle_order.count].id    = tmp.tracks.ids[t];
+               shuffle_order.count++;
+          }
+
+          track_list_clear( &tmp.tracks );
+     }
+
+     shuffle_order.enum_time = direct_clock_get_micros() - t0;
+
+     if (!shuffle_order.count)
+          return DR_ITEMNOTFOUND;
+
+     shuffle_order.next = D_MALLOC( shuffle_order.count * sizeof(ShuffleEntry) );
+     if (!shuffle_order.next)
+          return D_OOM();
+
+     shuffle_order.seed  = shuffle_seed ? strtoull( shuffle_seed, NULL, 0 ) : (u64) direct_clock_get_micros();
+     shuffle_order.state = shuffle_order.seed;
+
+     shuffle_permute( shuffle_order.entries, NULL );
+     shuffle_permute_next();
+
+     if (!quiet)
+          fprintf( stderr, "Shuffle: %d tracks, seed %llu\n", shuffle_order.count,
+                   (unsigned long long) shuffle_order.seed );
+
+     return DR_OK;
+}
+
+static void shuffle_free()
+{
+     if (shuffle_order.entries) {
+          D_FREE( shuffle_order.entries );
+          shuffle_order.entries = NULL;
+     }
+
+     if (shuffle_order.next) {
+          D_FREE( shuffle_order.next );
+          shuffle_order.next = NULL;
+     }
+}
+
+static Media *shuffle_media()
+{
+     return shuffle_order.entries[shuffle_order.pos].media;
+}
+
+/* move to the next pair in playback direction, a new permutation is started at the end in repeat mode */
+static Media *shuffle_step( int dir, int repeat )
+{
+     ShuffleEntry *entries;
+
+     shuffle_order.pos += dir;
+
+     if (shuffle_order.pos >= shuffle_order.count) {
+          if (!repeat) {
+               shuffle_order.pos = 0;
+               return NULL;
+          }
+
+          entries               = shuffle_order.entries;
+          shuffle_order.entries = shuffle_order.next;
+          shuffle_order.next    = entries;
+
+          shuffle_permute_next();
+
+          shuffle_order.pos = 0;
+          shuffle_order.passes++;
+     }
+     else if (shuffle_order.pos < 0) {
+          if (!repeat) {
+               shuffle_order.pos = 0;
+               return NULL;
+          }
+
+          shuffle_order.pos = shuffle_order.count - 1;
+     }
+
+     return shuffle_media();
+}
+
+/* keep only the track of the current pair */
+static void shuffle_filter_tracks( Media *media )
+{
+     int t, count = 0;
+
+     for (t = 0; t < media->tracks.count; t++) {
+          if (media->tracks.ids[t] == shuffle_order.entries[shuffle_order.pos].id)
+               media->tracks.ids[count++] = media->tracks.ids[t];
+     }
+
+     media->tracks.count = count;
+}
+
+static void print_switch_stats()
+{
+     fprintf( stderr, "Track switches (%s): %d, average latency %.3f ms, max %lld.%03lld ms\n",
+              shuffle ? "shuffle" : "sequential", switches, switch_total / 1000.0 / switches,
+              switch_max / 1000, switch_max % 1000 );
+
+     if (shuffle)
+          fprintf( stderr, "Shuffle: seed %llu, %d tracks, %d pass(es), enumerated in %lld.%03lld ms "
+                   "(%d medias probed, dropped from the page cache)\n",
+                   (unsigned long long) shuffle_order.seed, shuffle_order.count, shuffle_order.passes + 1,
+                   shuffle_order.enum_time / 1000, shuffle_order.enum_time % 1000, shuffle_order.probed );
+}
+
+/******************************************************************************/
+
+static void cache_path( const char *mrl, FSTrackID track, char *path, size_t size )
+{
+     snprintf( path, size, "%s/%08lx.%u.pcm", cache_dir, index_hash( mrl ), track );
+}
+
+/* size and modification time of a local media, other locations can not be validated and are not cached */
+static DirectResult cache_media_key( const char *mrl, s64 *ret_size, s64 *ret_mtime )
+{
+     struct stat st;
+
+     if (stat( mrl, &st ) || !S_ISREG( st.st_mode ))
+          return DR_FILENOTFOUND;
+
+     *ret_size  = st.st_size;
+     *ret_mtime = st.st_mtime;
+
+     return DR_OK;
+}
+
+static int compare_cache_files( const void *a, const void *b )
+{
+     const CacheFile *fa = a;
+     const CacheFile *fb = b;
+
+     return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+/* remove the least recently used files until <needed> bytes fit into the size limit */
+static void cache_evict( long long needed )
+{
+     DIR           *dir;
+     struct dirent *entry;
+     CacheFile     *files = NULL;
+     int            count = 0;
+     int            max   = 0;
+     long long      total = 0;
+     int            i;
+
+     dir = opendir( cache_dir );
+     if (!dir)
+          return;
+
+     while ((entry = readdir( dir )) != NULL) {
+          struct stat st;
+          char        path[1024];
+          size_t      len = strlen( entry->d_name );
+
+          if (len < 4 || strcmp( entry->d_name + len - 4, ".pcm" ))
+               continue;
+
+          snprintf( path, sizeof(path), "%s/%s", cache_dir, entry->d_name );
+
+          if (stat( path, &st ))
+               continue;
+
+          if (count == max) {
+               CacheFile *tmp;
+
+               max = MAX( max * 2, 32 );
+               tmp = D_REALLOC( files, max * sizeof(CacheFile) );
+               if (!tmp) {
+                    D_OOM();
+                    break;
+               }
+
+               files = tmp;
+          }
+
+          snprintf( files[count].name, sizeof(files[count].name), "%s", entry->d_name );
+          files[count].size  = st.st_size;
+          files[count].mtime = st.st_mtime;
+
+          total += st.st_size;
+          count++;
+     }
+
+     closedir( dir );
+
+     qsort( files, count, sizeof(CacheFile), compare_cache_files );
+
+     for (i = 0; i < count && total + needed > cache.limit; i++) {
+          char path[1024];
+
+          snprintf( path, sizeof(path), "%s/%s", cache_dir, files[i].name );
+
+          if (!unlink( path )) {
+               total -= files[i].size;
+               cache.evicted++;
+          }
+     }
+
+     if (files)
+          D_FREE( files );
+}
+
+/******************************************************************************/
+
+static DirectResult cache_provider_add_ref( IFusionSoundMusicProvider *thiz )
+{
+     thiz->refs++;
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_stop( IFusionSoundMusicProvider *thiz )
+{
+     CachePlayer *player = thiz->priv;
+
+     direct_mutex_lock( &player->lock );
+
+     if (player->thread) {
+          player->stop = 1;
+
+          direct_mutex_unlock( &player->lock );
+          direct_thread_join( player->thread );
+          direct_mutex_lock( &player->lock );
+
+          direct_thread_destroy( player->thread );
+          player->thread = NULL;
+     }
+
+     if (player->status != FMSTATE_FINISHED)
+          player->status = FMSTATE_STOP;
+
+     direct_waitqueue_broadcast( &player->cond );
+
+     direct_mutex_unlock( &player->lock );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_release( IFusionSoundMusicProvider *thiz )
+{
+     CachePlayer *player = thiz->priv;
+
+     if (--thiz->refs)
+          return DR_OK;
+
+     cache_provider_stop( thiz );
+
+     /* the decoding cost of the served part of the track is saved */
+     cache.served_audio += (double) player->served / player->header->samplerate;
+     cache.served_cpu   += player->cpu;
+     cache.saved_cpu    += player->header->decode_cpu * player->served / player->header->frames;
+
+     munmap( player->map, player->map_size );
+
+     direct_waitqueue_deinit( &player->cond );
+     direct_mutex_deinit( &player->lock );
+
+     D_FREE( player );
+     D_FREE( thiz );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_capabilities( IFusionSoundMusicProvider *thiz, FSMusicProviderCapabilities *caps )
+{
+     *caps = FMCAPS_BASIC | FMCAPS_SEEK;
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_enum_tracks( IFusionSoundMusicProvider *thiz, FSTrackCallback callback, void *ctx )
+{
+     CachePlayer        *player = thiz->priv;
+     FSTrackDescription  desc;
+
+     memset( &desc, 0, sizeof(desc) );
+
+     callback( player->header->track, desc, ctx );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_track_id( IFusionSoundMusicProvider *thiz, FSTrackID *ret_track_id )
+{
+     CachePlayer *player = thiz->priv;
+
+     *ret_track_id = player->header->track;
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_track_description( IFusionSoundMusicProvider *thiz, FSTrackDescription *desc )
+{
+     memset( desc, 0, sizeof(FSTrackDescription) );
+
+     snprintf( desc->encoding, sizeof(desc->encoding), "PCM" );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_stream_description( IFusionSoundMusicProvider *thiz, FSStreamDescription *desc )
+{
+     CachePlayer *player = thiz->priv;
+
+     memset( desc, 0, sizeof(FSStreamDescription) );
+
+     desc->flags        = FSSDF_CHANNELS | FSSDF_SAMPLEFORMAT | FSSDF_SAMPLERATE;
+     desc->channels     = player->header->channels;
+     desc->sampleformat = player->header->sampleformat;
+     desc->samplerate   = player->header->samplerate;
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_buffer_description( IFusionSoundMusicProvider *thiz, FSBufferDescription *desc )
+{
+     CachePlayer *player = thiz->priv;
+
+     memset( desc, 0, sizeof(FSBufferDescription) );
+
+     desc->flags        = FSBDF_LENGTH | FSBDF_CHANNELS | FSBDF_SAMPLEFORMAT | FSBDF_SAMPLERATE;
+     desc->length       = player->header->samplerate / 10;
+     desc->channels     = player->header->channels;
+     desc->sampleformat = player->header->sampleformat;
+     desc->samplerate   = player->header->samplerate;
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_select_track( IFusionSoundMusicProvider *thiz, FSTrackID track_id )
+{
+     CachePlayer *player = thiz->priv;
+
+     return track_id == player->header->track ? DR_OK : DR_INVARG;
+}
+
+/* the decoded frames are copied from the mapping, the buffer callback paces the playback */
+static void *cache_player_thread( DirectThread *thread, void *arg )
+{
+     CachePlayer         *player = arg;
+     FSBufferDescription  desc;
+
+     player->buffer->GetDescription( player->buffer, &desc );
+
+     direct_mutex_lock( &player->lock );
+
+     while (!player->stop) {
+          long long  pos    = player->pos;
+          int        frames = MIN( desc.length, player->header->frames - pos );
+          void      *data;
+
+          if (frames <= 0) {
+               if (player->flags & FMPLAY_LOOPING) {
+                    player->pos = 0;
+                    continue;
+               }
+
+               player->status = FMSTATE_FINISHED;
+               break;
+          }
+
+          direct_mutex_unlock( &player->lock );
+
+          if (player->buffer->Lock( player->buffer, &data, NULL, NULL ) == DR_OK) {
+               /* only the copy replaces the decoding, the callback runs the same pipeline in both cases */
+               long long cpu0 = direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID );
+
+               memcpy( data, player->data + pos * player->frame_size, frames * player->frame_size );
+
+               player->cpu += direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID ) - cpu0;
+
+               player->buffer->Unlock( player->buffer );
+
+               player->callback( frames, player->ctx );
+          }
+
+          direct_mutex_lock( &player->lock );
+
+          /* a seek during the callback has set the position */
+          if (player->seeked)
+               player->seeked = 0;
+          else
+               player->pos = pos + frames;
+
+          player->served += frames;
+     }
+
+     direct_waitqueue_broadcast( &player->cond );
+
+     direct_mutex_unlock( &player->lock );
+
+     return NULL;
+}
+
+static DirectResult cache_provider_play_to_stream( IFusionSoundMusicProvider *thiz, IFusionSoundStream *destination )
+{
+     /* the cache is only played through the decoded audio pipeline */
+     return DR_UNSUPPORTED;
+}
+
+static DirectResult cache_provider_play_to_buffer( IFusionSoundMusicProvider *thiz, IFusionSoundBuffer *destination,
+                                                   FMBufferCallback callback, void *ctx )
+{
+     CachePlayer *player = thiz->priv;
+
+     direct_mutex_lock( &player->lock );
+
+     if (player->thread && player->status == FMSTATE_PLAY) {
+          direct_mutex_unlock( &player->lock );
+          return DR_OK;
+     }
+
+     direct_mutex_unlock( &player->lock );
+
+     cache_provider_stop( thiz );
+
+     direct_mutex_lock( &player->lock );
+
+     if (player->status == FMSTATE_FINISHED)
+          player->pos = 0;
+
+     player->buffer   = destination;
+     player->callback = callback;
+     player->ctx      = ctx;
+     player->stop     = 0;
+     player->status   = FMSTATE_PLAY;
+     player->thread   = direct_thread_create( DTT_DEFAULT, cache_player_thread, player, "Cache Player" );
+
+     direct_waitqueue_broadcast( &player->cond );
+
+     direct_mutex_unlock( &player->lock );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_status( IFusionSoundMusicProvider *thiz, FSMusicProviderStatus *ret_status )
+{
+     CachePlayer *player = thiz->priv;
+
+     direct_mutex_lock( &player->lock );
+
+     *ret_status = player->status;
+
+     direct_mutex_unlock( &player->lock );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_seek_to( IFusionSoundMusicProvider *thiz, double seconds )
+{
+     CachePlayer *player = thiz->priv;
+
+     direct_mutex_lock( &player->lock );
+
+     player->pos    = CLAMP( (long long) (seconds * player->header->samplerate), 0, player->header->frames );
+     player->seeked = player->thread != NULL;
+
+     direct_mutex_unlock( &player->lock );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_pos( IFusionSoundMusicProvider *thiz, double *ret_seconds )
+{
+     CachePlayer *player = thiz->priv;
+
+     direct_mutex_lock( &player->lock );
+
+     *ret_seconds = (double) player->pos / player->header->samplerate;
+
+     direct_mutex_unlock( &player->lock );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_get_length( IFusionSoundMusicProvider *thiz, double *ret_seconds )
+{
+     CachePlayer *player = thiz->priv;
+
+     *ret_seconds = (double) player->header->frames / player->header->samplerate;
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_set_playback_flags( IFusionSoundMusicProvider *thiz,
+                                                       FSMusicProviderPlaybackFlags flags )
+{
+     CachePlayer *player = thiz->priv;
+
+     direct_mutex_lock( &player->lock );
+
+     player->flags = flags;
+
+     direct_mutex_unlock( &player->lock );
+
+     return DR_OK;
+}
+
+static DirectResult cache_provider_wait_status( IFusionSoundMusicProvider *thiz, FSMusicProviderStatus mask,
+                                                unsigned int timeout )
+{
+     CachePlayer  *player   = thiz->priv;
+     DirectResult  ret      = DR_OK;
+     long long     deadline = direct_clock_get_micros() + timeout * 1000LL;
+
+     direct_mutex_lock( &player->lock );
+
+     /* wakeups for other status changes do not extend the timeout */
+     while (!(player->status & mask)) {
+          if (timeout) {
+               long long remaining = deadline - direct_clock_get_micros();
+
+               if (remaining <= 0) {
+                    ret = DR_TIMEOUT;
+                    break;
+               }
+
+               ret = direct_waitqueue_wait_timeout( &player->cond, &player->lock, remaining );
+               if (ret)
+                    break;
+          }
+          else
+               direct_waitqueue_wait( &player->cond, &player->lock );
+     }
+
+     direct_mutex_unlock( &player->lock );
+
+     return ret;
+}
+
+/* open a cached track as a music provider, if its decoded format matches the pipeline */
+static IFusionSoundMusicProvider *cache_open( const char *mrl, FSTrackID track, const FSBufferDescription *format )
+{
+     IFusionSoundMusicProvider *thiz;
+     CachePlayer               *player;
+     CacheHeader               *header;
+     char                       path[1024];
+     struct stat                st;
+     void                      *map;
+     int                        fd;
+     s64                        size, mtime;
+     size_t                     offset;
+
+     if (cache_media_key( mrl, &size, &mtime ))
+          return NULL;
+
+     cache_path( mrl, track, path, sizeof(path) );
+
+     fd = open( path, O_RDONLY );
+     if (fd < 0)
+          return NULL;
+
+     if (fstat( fd, &st ) || st.st_size < sizeof(CacheHeader)) {
+          close( fd );
+          return NULL;
+     }
+
+     map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+     if (map == MAP_FAILED) {
+          close( fd );
+          return NULL;
+     }
+
+     header = map;
+     offset = sizeof(CacheHeader) + CACHE_MRL_SIZE( mrl );
+
+     /* the file name is a hash of the location, the stored location tells collisions apart */
+     if (header->magic != CACHE_MAGIC || header->track != track || header->size != size || header->mtime != mtime ||
+         header->sampleformat != format->sampleformat || header->channels != format->channels ||
+         header->samplerate != format->samplerate || header->frames <= 0 ||
+         header->mrl_size != CACHE_MRL_SIZE( mrl ) || st.st_size < offset ||
+         strcmp( (const char*) (header + 1), mrl ) ||
+         st.st_size != offset + header->frames * header->channels * FS_BYTES_PER_SAMPLE(header->sampleformat)) {
+          munmap( map, st.st_size );
+          close( fd );
+          return NULL;
+     }
+
+     /* the modification time orders the files for eviction */
+     futimens( fd, NULL );
+
+     close( fd );
+
+     madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+     thiz   = D_CALLOC( 1, sizeof(IFusionSoundMusicProvider) );
+     player = D_CALLOC( 1, sizeof(CachePlayer) );
+     if (!thiz || !player) {
+          D_OOM();
+          if (thiz)
+               D_FREE( thiz );
+          if (player)
+               D_FREE( player );
+          munmap( map, st.st_size );
+          return NULL;
+     }
+
+     player->map        = map;
+     player->map_size   = st.st_size;
+     player->header     = header;
+     player->data       = (const u8*) map + offset;
+     player->frame_size = header->channels * FS_BYTES_PER_SAMPLE(header->sampleformat);
+     player->status     = FMSTATE_STOP;
+
+     direct_mutex_init( &player->lock );
+     direct_waitqueue_init( &player->cond );
+
+     thiz->priv                 = player;
+     thiz->refs                 = 1;
+     thiz->AddRef               = cache_provider_add_ref;
+     thiz->Release              = cache_provider_release;
+     thiz->GetCapabilities      = cache_provider_get_capabilities;
+     thiz->EnumTracks           = cache_provider_enum_tracks;
+     thiz->GetTrackID           = cache_provider_get_track_id;
+     thiz->GetTrackDescription  = cache_provider_get_track_description;
+     thiz->GetStreamDescription = cache_provider_get_stream_description;
+     thiz->GetBufferDescription = cache_provider_get_buffer_description;
+     thiz->SelectTrack          = cache_provider_select_track;
+     thiz->PlayToStream         = cache_provider_play_to_stream;
+     thiz->PlayToBuffer         = cache_provider_play_to_buffer;
+     thiz->Stop                 = cache_provider_stop;
+     thiz->GetStatus            = cache_provider_get_status;
+     thiz->SeekTo               = cache_provider_seek_to;
+     thiz->GetPos               = cache_provider_get_pos;
+     thiz->GetLength            = cache_provider_get_length;
+     thiz->SetPlaybackFlags     = cache_provider_set_playback_flags;
+     thiz->WaitStatus           = cache_provider_wait_status;
+
+     cache.hits++;
+
+     return thiz;
+}
+
+/******************************************************************************/
+
+typedef struct {
+     IFusionSoundBuffer *buffer;
+     int                 fd;
+     int                 frame_size;
+     long long           frames;
+     long long           cpu;
+     int                 error;
+} CacheWriter;
+
+/*
+ * Runs in the decoding thread of the music provider, which is created by PlayToBuffer(), so the CPU time of the
+ * thread is the decoding cost from the start of the track including the decoding before the first callback.
+ */
+static int cache_cb( int length, void *ctx )
+{
+     CacheWriter *writer = ctx;
+     void        *data;
+     ssize_t      bytes  = (ssize_t) length * writer->frame_size;
+
+     if (writer->error || writer->buffer->Lock( writer->buffer, &data, NULL, NULL ))
+          return 0;
+
+     if (write( writer->fd, data, bytes ) != bytes)
+          writer->error = 1;
+     else
+          writer->frames += length;
+
+     writer->buffer->Unlock( writer->buffer );
+
+     writer->cpu = direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID );
+
+     return 0;
+}
+
+/* decode a track to a temporary file, renamed when complete */
+static void cache_decode( CacheJob *job )
+{
+     IFusionSoundMusicProvider *provider;
+     IFusionSoundBuffer        *buffer;
+     FSBufferDescription        desc;
+     FSMusicProviderStatus      status = FMSTATE_UNKNOWN;
+     CacheHeader                header;
+     CacheWriter                writer;
+     char                       path[1024];
+     char                       tmp[1040];
+     char                       padding[8] = { 0 };
+     double                     length = 0;
+     long long                  estimate;
+     size_t                     mrl_length;
+
+     memset( &header, 0, sizeof(header) );
+     memset( &writer, 0, sizeof(writer) );
+
+     if (cache_media_key( job->mrl, &header.size, &header.mtime ))
+          return;
+
+     if (sound->CreateMusicProvider( sound, job->mrl, &provider ))
+          return;
+
+     if (provider->SelectTrack( provider, job->track ) ||
+         provider->GetBufferDescription( provider, &desc ) ||
+         sound->CreateBuffer( sound, &desc, &buffer )) {
+          provider->Release( provider );
+          return;
+     }
+
+     mrl_length = strlen( job->mrl );
+
+     header.magic        = CACHE_MAGIC;
+     header.track        = job->track;
+     header.sampleformat = desc.sampleformat;
+     header.channels     = desc.channels;
+     header.samplerate   = desc.samplerate;
+     header.mrl_size     = CACHE_MRL_SIZE( job->mrl );
+
+     writer.buffer     = buffer;
+     writer.frame_size = desc.channels * FS_BYTES_PER_SAMPLE(desc.sampleformat);
+
+     /* make room for the track, unless it does not fit at all */
+     provider->GetLength( provider, &length );
+
+     estimate = sizeof(CacheHeader) + header.mrl_size + (long long) (length * desc.samplerate) * writer.frame_size;
+     if (estimate > cache.limit) {
+          buffer->Release( buffer );
+          provider->Release( provider );
+          return;
+     }
+
+     cache_evict( estimate );
+
+     cache_path( job->mrl, job->track, path, sizeof(path) );
+     snprintf( tmp, sizeof(tmp), "%s.tmp", path );
+
+     writer.fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+     if (writer.fd < 0 || write( writer.fd, &header, sizeof(header) ) != sizeof(header) ||
+         write( writer.fd, job->mrl, mrl_length ) != mrl_length ||
+         write( writer.fd, padding, header.mrl_size - mrl_length ) != header.mrl_size - mrl_length)
+          writer.error = 1;
+
+     if (!writer.error && provider->PlayToBuffer( provider, buffer, cache_cb, &writer ) == DR_OK) {
+          while (status != FMSTATE_FINISHED && status != FMSTATE_STOP && !cache.stop) {
+               provider->WaitStatus( provider, FMSTATE_FINISHED | FMSTATE_STOP, 100 );
+               provider->GetStatus( provider, &status );
+          }
+
+          provider->Stop( provider );
+     }
+
+     buffer->Release( buffer );
+     provider->Release( provider );
+
+     header.frames     = writer.frames;
+     header.decode_cpu = writer.cpu;
+
+     if (writer.fd >= 0) {
+          if (status != FMSTATE_FINISHED || writer.error || !writer.frames ||
+              pwrite( writer.fd, &header, sizeof(header), 0 ) != sizeof(header)) {
+               close( writer.fd );
+               unlink( tmp );
+               return;
+          }
+
+          close( writer.fd );
+
+          if (rename( tmp, path )) {
+               unlink( tmp );
+               return;
+          }
+     }
+     else
+          return;
+
+     direct_mutex_lock( &cache.lock );
+
+     cache.decoded++;
+     cache.decoded_audio += (double) writer.frames / desc.samplerate;
+     cache.decoded_cpu   += writer.cpu;
+     cache.generation++;
+
+     direct_mutex_unlock( &cache.lock );
+}
+
+static void *cache_thread( DirectThread *thread, void *arg )
+{
+     direct_mutex_lock( &cache.lock );
+
+     while (!cache.stop) {
+          CacheJob *job = (CacheJob*) cache.jobs;
+
+          if (!job) {
+               direct_waitqueue_wait( &cache.cond, &cache.lock );
+               continue;
+          }
+
+          direct_list_remove( &cache.jobs, &job->link );
+
+          direct_mutex_unlock( &cache.lock );
+
+          cache_decode( job );
+
+          D_FREE( job->mrl );
+          D_FREE( job );
+
+          direct_mutex_lock( &cache.lock );
+     }
+
+     direct_mutex_unlock( &cache.lock );
+
+     return NULL;
+}
+
+/* queue a track for decoding in the background, unless queued or cached already */
+static void cache_request( const char *mrl, FSTrackID track )
+{
+     CacheJob *job;
+     char      path[1024];
+     s64       size, mtime;
+
+     if (cache_media_key( mrl, &size, &mtime ))
+          return;
+
+     cache_path( mrl, track, path, sizeof(path) );
+
+     if (!access( path, R_OK ))
+          return;
+
+     direct_mutex_lock( &cache.lock );
+
+     direct_list_foreach (job, cache.jobs) {
+          if (job->track == track && !strcmp( job->mrl, mrl ))
+               break;
+     }
+
+     if (!job) {
+          job = D_CALLOC( 1, sizeof(CacheJob) );
+          if (job) {
+               job->mrl   = D_STRDUP( mrl );
+               job->track = track;
+
+               if (job->mrl) {
+                    direct_list_append( &cache.jobs, &job->link );
+                    direct_waitqueue_broadcast( &cache.cond );
+               }
+               else
+                    D_FREE( job );
+          }
+
+          if (!job || !job->mrl)
+               D_OOM();
+     }
+
+     direct_mutex_unlock( &cache.lock );
+}
+
+static void cache_init()
+{
+     mkdir( cache_dir, 0755 );
+
+     cache.limit = (long long) cache_size << 20;
+
+     direct_mutex_init( &cache.lock );
+     direct_waitqueue_init( &cache.cond );
+
+     cache.thread = direct_thread_create( DTT_DEFAULT, cache_thread, NULL, "PCM Cache" );
+}
+
+static void cache_shutdown()
+{
+     CacheJob *job, *job_next;
+
+     if (!cache.thread)
+          return;
+
+     direct_mutex_lock( &cache.lock );
+     cache.stop = 1;
+     direct_waitqueue_broadcast( &cache.cond );
+     direct_mutex_unlock( &cache.lock );
+
+     direct_thread_join( cache.thread );
+     direct_thread_destroy( cache.thread );
+     cache.thread = NULL;
+
+     direct_list_foreach_safe (job, job_next, cache.jobs) {
+          D_FREE( job->mrl );
+          D_FREE( job );
+     }
+
+     cache.jobs = NULL;
+
+     direct_waitqueue_deinit( &cache.cond );
+     direct_mutex_deinit( &cache.lock );
+}
+
+static void print_cache_stats()
+{
+     fprintf( stderr, "PCM cache: %d hits, %d tracks decoded in the background (%.1f s of audio, CPU %lld ms), "
+              "%d evicted\n", cache.hits, cache.decoded, cache.decoded_audio, cache.decoded_cpu / 1000, cache.evicted );
+
+     /* the tracks decoded in the background were decoded twice on their first play */
+     if (cache.served_audio)
+          fprintf( stderr, "PCM cache: %.1f s of audio served with CPU %lld ms for copying instead of %lld ms of "
+                   "decoding, %lld ms saved, %lld ms net of the background decoding\n", cache.served_audio,
+                   cache.served_cpu / 1000, cache.saved_cpu / 1000, (cache.saved_cpu - cache.served_cpu) / 1000,
+                   (cache.saved_cpu - cache.served_cpu - cache.decoded_cpu) / 1000 );
+}
+
+/******************************************************************************/
+
+#define AUTOTUNE_WINDOW   2000   /* playback time in ms for each buffer size */
+#define AUTOTUNE_MINIMUM  128    /* minimum buffer size in frames */
+#define AUTOTUNE_SAMPLING 250    /* minimum telemetry sampling interval in us */
+
+/* shrink the buffer size until underruns appear on the current track, then back off */
+static int autotune_buffersize( IFusionSoundMusicProvider *provider, Media *media, FSTrackID track_id,
+                                const FSStreamDescription *desc )
+{
+     FSStreamDescription   sdsc = *desc;
+     FSMusicProviderStatus status;
+     int                   size;
+     int                   best = 0;
+
+     size = (sdsc.flags & FSSDF_BUFFERSIZE) ? sdsc.buffersize : sdsc.samplerate / 2;
+
+     while (size >= AUTOTUNE_MINIMUM) {
+          int underruns;
+
+          sdsc.flags      |= FSSDF_BUFFERSIZE;
+          sdsc.buffersize  = size;
+
+          if (sound->CreateStream( sound, &sdsc, &stream ))
+               break;
+
+          stream->GetPlayback( stream, &playback );
+
+          if (use_pipeline) {
+               FSStreamDescription dsc;
+
+               stream->GetDescription( stream, &dsc );
+               pipeline_setup( provider, &dsc );
+          }
+
+          provider->SeekTo( provider, 0 );
+
+          /*
+           * Sample the ring buffer four times per buffer length. Underruns shorter than the sampling interval can
+           * still go unnoticed, so the result is reported together with the interval.
+           */
+          telemetry_interval = CLAMP( (long long) size * 250000 / sdsc.samplerate,
+                                      AUTOTUNE_SAMPLING, TELEMETRY_INTERVAL * 1000 );
+
+          telemetry_start( provider, media, track_id );
+
+          start_playback( provider );
+
+          provider->WaitStatus( provider, FMSTATE_FINISHED, AUTOTUNE_WINDOW );
+          provider->GetStatus( provider, &status );
+
+          telemetry_stop();
+
+          underruns = telemetry.underruns;
+
+          provider->Stop( provider );
+
+          playback->Release( playback );
+          playback = NULL;
+          stream->Release( stream );
+          stream = NULL;
+
+          if (!quiet)
+               fprintf( stderr, "Auto-tune: %d frames (%d ms): %d underruns (sampled every %d us)\n",
+                        size, size * 1000 / sdsc.samplerate, underruns, telemetry_interval );
+
+          if (underruns || status == FMSTATE_FINISHED)
+               break;
+
+          best  = size;
+          size /= 2;
+     }
+
+     provider->SeekTo( provider, 0 );
+
+     telemetry_interval = TELEMETRY_INTERVAL * 1000;
+
+     /* back off with a margin from the smallest buffer size without underruns */
+     if (!best)
+          return (desc->flags & FSSDF_BUFFERSIZE) ? desc->buffersize : sdsc.samplerate / 2;
+
+     return best + best / 2;
+}
+
+/******************************************************************************/
+
+static GainEntry *gain_cache_find( const char *path, long long size, long long mtime, FSTrackID id )
+{
+     int i;
+
+     for (i = 0; i < gain_entry_count; i++) {
+          GainEntry *entry = &gain_entries[i];
+
+          if (entry->id == id && entry->size == size && entry->mtime == mtime && !strcmp( entry->path, path ))
+               return entry;
+     }
+
+     return NULL;
+}
+
+static GainEntry *gain_cache_add( const char *path, long long size, long long mtime, FSTrackID id )
+{
+     GainEntry *entry = gain_cache_find( path, size, mtime, id );
+
+     if (entry)
+          return entry;
+
+     if (gain_entry_count == gain_entry_max) {
+          int        max     = gain_entry_max ? gain_entry_max * 2 : 64;
+          GainEntry *entries = D_REALLOC( gain_entries, max * sizeof(GainEntry) );
+
+          if (!entries) {
+               D_OOM();
+               return NULL;
+          }
+
+          gain_entries   = entries;
+          gain_entry_max = max;
+     }
+
+     entry = &gain_entries[gain_entry_count++];
+
+     memset( entry, 0, sizeof(GainEntry) );
+
+     entry->path  = D_STRDUP( path );
+     entry->size  = size;
+     entry->mtime = mtime;
+     entry->id    = id;
+
+     return entry;
+}
+
+static void gain_cache_load()
+{
+     FILE      *f;
+     char       line[4096];
+     long long  size, mtime;
+     unsigned   id;
+     float      track_gain, album_gain;
+     int        n;
+
+     f = fopen( gain_cache_file, "r" );
+     if (!f)
+          return;
+
+     /* one entry per line: size mtime track track_gain album_gain path */
+     while (fgets( line, sizeof(line), f )) {
+          GainEntry *entry;
+
+          line[strcspn( line, "\n" )] = 0;
+
+          if (sscanf( line, "%lld %lld %u %f %f %n", &size, &mtime, &id, &track_gain, &album_gain, &n ) < 5)
+               continue;
+
+          entry = gain_cache_add( line + n, size, mtime, id );
+          if (entry) {
+               entry->track_gain = track_gain;
+               entry->album_gain = album_gain;
+          }
+     }
+
+     fclose( f );
+}
+
+/* drop the entries of files that were removed or changed since they were analyzed */
+static void gain_cache_prune()
+{
+     struct stat st;
+     int         i, n = 0;
+
+     for (i = 0; i < gain_entry_count; i++) {
+          GainEntry *entry = &gain_entries[i];
+
+          if (stat( entry->path, &st ) || st.st_size != entry->size || st.st_mtime != entry->mtime) {
+               D_FREE( entry->path );
+               continue;
+          }
+
+          gain_entries[n++] = *entry;
+     }
+
+     gain_entry_count = n;
+}
+
+static void gain_cache_save()
+{
+     FILE *f;
+     int   i;
+
+     f = fopen( gain_cache_file, "w" );
+     if (!f) {
+          fprintf( stderr, "Failed to write gain cache '%s'!\n", gain_cache_file );
+          return;
+     }
+
+     for (i = 0; i < gain_entry_count; i++)
+          fprintf( f, "%lld %lld %u %f %f %s\n", gain_entries[i].size, gain_entries[i].mtime, gain_entries[i].id,
+                   gain_entries[i].track_gain, gain_entries[i].album_gain, gain_entries[i].path );
+
+     fclose( f );
+}
+
+static void gain_cache_free()
+{
+     int i;
+
+     for (i = 0; i < gain_entry_count; i++)
+          D_FREE( gain_entries[i].path );
+
+     if (gain_entries)
+          D_FREE( gain_entries );
+
+     gain_entries     = NULL;
+     gain_entry_count = gain_entry_max = 0;
+}
+
+static GainEntry *gain_cache_lookup( const char *path, FSTrackID id )
+{
+     struct stat st;
+
+     if (stat( path, &st ))
+          return NULL;
+
+     return gain_cache_find( path, st.st_size, st.st_mtime, id );
+}
+
+static void loudness_init( Loudness *loudness, const FSBufferDescription *desc )
+{
+     double rate = desc->samplerate;
+     double f0, g, q, k, vh, vb, a0;
+
+     memset( loudness, 0, sizeof(Loudness) );
+
+     loudness->desc       = *desc;
+     loudness->sub_length = desc->samplerate / 10;
+
+     /* high shelf */
+     f0 = 1681.974450955533;
+     g  = 3.999843853973347;
+     q  = 0.7071752369554196;
+     k  = tan( M_PI * f0 / rate );
+     vh = pow( 10, g / 20 );
+     vb = pow( vh, 0.4996667741545416 );
+     a0 = 1 + k / q + k * k;
+
+     loudness->b[0][0] = (vh + vb * k / q + k * k) / a0;
+     loudness->b[0][1] = 2 * (k * k - vh) / a0;
+     loudness->b[0][2] = (vh - vb * k / q + k * k) / a0;
+     loudness->a[0][1] = 2 * (k * k - 1) / a0;
+     loudness->a[0][2] = (1 - k / q + k * k) / a0;
+
+     /* high pass */
+     f0 = 38.13547087602444;
+     q  = 0.5003270373238773;
+     k  = tan( M_PI * f0 / rate );
+     a0 = 1 + k / q + k * k;
+
+     loudness->b[1][0] = 1;
+     loudness->b[1][1] = -2;
+     loudness->b[1][2] = 1;
+     loudness->a[1][1] = 2 * (k * k - 1) / a0;
+     loudness->a[1][2] = (1 - k / q + k * k) / a0;
+}
+
+static void loudness_add_block( Loudness *loudness, double energy )
+{
+     if (loudness->num_blocks == loudness->max_blocks) {
+          int     max    = loudness->max_blocks ? loudness->max_blocks * 2 : 1024;
+          double *blocks = D_REALLOC( loudness->blocks, max * sizeof(double) );
+
+          if (!blocks)
+               return;
+
+          loudness->blocks     = blocks;
+          loudness->max_blocks = max;
+     }
+
+     loudness->blocks[loudness->num_blocks++] = energy;
+}
+
+static void loudness_process( Loudness *loudness, const float *pcm, int frames )
+{
+     int channels = MIN( loudness->desc.channels, METER_CHANNELS );
+     int i, c, f;
+
+     for (i = 0; i < frames; i++) {
+          for (c = 0; c < channels; c++) {
+               double x = pcm[i * loudness->desc.channels + c];
+
+               /* transposed direct form II biquads */
+               for (f = 0; f < 2; f++) {
+                    double *z = loudness->z[c][f];
+                    double  y = loudness->b[f][0] * x + z[0];
+
+                    z[0] = loudness->b[f][1] * x - loudness->a[f][1] * y + z[1];
+                    z[1] = loudness->b[f][2] * x - loudness->a[f][2] * y;
+
+                    x = y;
+               }
+
+               loudness->sub_sum[c] += x * x;
+          }
+
+          if (++loudness->sub_frames == loudness->sub_length) {
+               double energy = 0;
+
+               /* channel weights: LFE excluded, surround channels +1.5 dB */
+               for (c = 0; c < channels; c++) {
+                    double weight = 1;
+
+                    if (channels > 4 && c == 3)
+                         weight = 0;
+                    else if (channels > 4 && c >= 4)
+                         weight = 1.41;
+
+                    energy += weight * loudness->sub_sum[c] / loudness->sub_length;
+
+                    loudness->sub_sum[c] = 0;
+               }
+
+               loudness->sub_energy[loudness->sub_count++ % 4] = energy;
+               loudness->sub_frames = 0;
+
+               if (loudness->sub_count >= 4)
+                    loudness_add_block( loudness, (loudness->sub_energy[0] + loudness->sub_energy[1] +
+                                                   loudness->sub_energy[2] + loudness->sub_energy[3]) / 4 );
+          }
+     }
+
+     loudness->frames += frames;
+}
+
+/* gated integrated loudness in LUFS of a set of blocks */
+static double loudness_integrate( double *const *blocks, const int *num_blocks, int sets )
+{
+     double sum   = 0;
+     int    count = 0;
+     double relative;
+     int    i, j;
+
+     /* absolute gate at -70 LUFS */
+     for (i = 0; i < sets; i++) {
+          for (j = 0; j < num_blocks[i]; j++) {
+               if (-0.691 + 10 * log10( blocks[i][j] + 1e-20 ) > -70) {
+                    sum += blocks[i][j];
+                    count++;
+               }
+          }
+     }
+
+     if (!count)
+          return -70;
+
+     /* relative gate at -10 LU */
+     relative = -0.691 + 10 * log10( sum / count ) - 10;
+
+     sum   = 0;
+     count = 0;
+
+     for (i = 0; i < sets; i++) {
+          for (j = 0; j < num_blocks[i]; j++) {
+               double l = -0.691 + 10 * log10( blocks[i][j] + 1e-20 );
+
+               if (l > -70 && l > relative) {
+                    sum += blocks[i][j];
+                    count++;
+               }
+          }
+     }
+
+     return count ? -0.691 + 10 * log10( sum / count ) : -70;
+}
+
+static float loudness_gain( double lufs )
+{
+     return pow( 10, (LOUDNESS_REFERENCE - lufs) / 20 );
+}
+
+static int loudness_cb( int length, void *ctx )
+{
+     Loudness *loudness = ctx;
+     void     *data;
+
+     if (loudness->buffer->Lock( loudness->buffer, &data, NULL, NULL ))
+          return 0;
+
+     length = MIN( length, loudness->desc.length );
+
+     pcm_to_float( data, loudness->desc.sampleformat, length * loudness->desc.channels, loudness->pcm );
+
+     loudness->buffer->Unlock( loudness->buffer );
+
+     loudness_process( loudness, loudness->pcm, length );
+
+     return 0;
+}
+
+/* analysis thread pool */
+typedef struct {
+     DirectMutex  lock;
+     int          next;       /* index of the next media */
+     DirectLink  *results;
+     int          analyzed;
+     int          skipped;
+} Analysis;
+
+static Analysis analysis;
+
+static void analyze_track( IFusionSoundMusicProvider *provider, Media *media, FSTrackID id )
+{
+     DirectResult           ret;
+     FSTrackDescription     desc;
+     FSBufferDescription    bdsc;
+     FSMusicProviderStatus  status = FMSTATE_UNKNOWN;
+     Loudness               loudness;
+     GainResult            *result;
+
+     if (provider->SelectTrack( provider, id ))
+          return;
+
+     provider->GetTrackDescription( provider, &desc );
+     provider->GetBufferDescription( provider, &bdsc );
+
+     direct_mutex_lock( &analysis.lock );
+
+     /* tagged or already analyzed */
+     if (desc.replaygain > 0.0 || gain_cache_lookup( media->mrl, id )) {
+          analysis.skipped++;
+          direct_mutex_unlock( &analysis.lock );
+          return;
+     }
+
+     direct_mutex_unlock( &analysis.lock );
+
+     loudness_init( &loudness, &bdsc );
+
+     loudness.pcm = D_MALLOC( bdsc.length * bdsc.channels * sizeof(float) );
+     if (!loudness.pcm) {
+          D_OOM();
+          return;
+     }
+
+     ret = sound->CreateBuffer( sound, &bdsc, &loudness.buffer );
+     if (ret) {
+          D_FREE( loudness.pcm );
+          return;
+     }
+
+     if (provider->PlayToBuffer( provider, loudness.buffer, loudness_cb, &loudness ) == DR_OK) {
+          while (status != FMSTATE_FINISHED && status != FMSTATE_STOP) {
+               provider->WaitStatus( provider, FMSTATE_FINISHED | FMSTATE_STOP, 0 );
+               provider->GetStatus( provider, &status );
+          }
+
+          provider->Stop( provider );
+     }
+
+     loudness.buffer->Release( loudness.buffer );
+     D_FREE( loudness.pcm );
+
+     result = D_CALLOC( 1, sizeof(GainResult) );
+     if (!result) {
+          D_OOM();
+          D_FREE( loudness.blocks );
+          return;
+     }
+
+     result->media      = media;
+     result->id         = id;
+     result->blocks     = loudness.blocks;
+     result->num_blocks = loudness.num_blocks;
+     result->seconds    = (double) loudness.frames / bdsc.samplerate;
+     result->track_gain = loudness_gain( loudness_integrate( &result->blocks, &result->num_blocks, 1 ) );
+
+     /* tracks without album tag form an album per media */
+     snprintf( result->album, sizeof(result->album), "%s", *desc.album ? desc.album : media->mrl );
+
+     direct_mutex_lock( &analysis.lock );
+     direct_list_append( &analysis.results, &result->link );
+     analysis.analyzed++;
+     direct_mutex_unlock( &analysis.lock );
+}
+
+static void *analysis_thread( DirectThread *thread, void *arg )
+{
+     while (1) {
+          IFusionSoundMusicProvider *provider;
+          Media                     *media;
+          Media                      tmp;
+          int                        t;
+
+          /* take the next media */
+          direct_mutex_lock( &analysis.lock );
+
+          media = playlist_media( analysis.next );
+          if (media)
+               analysis.next++;
+
+          direct_mutex_unlock( &analysis.lock );
+
+          if (!media)
+               break;
+
+          if (sound->CreateMusicProvider( sound, media->mrl, &provider ))
+               continue;
+
+          memset( &tmp, 0, sizeof(tmp) );
+
+          provider->EnumTracks( provider, track_cb, &tmp );
+
+          for (t = 0; t < tmp.tracks.count; t++)
+               analyze_track( provider, media, tmp.tracks.ids[t] );
+
+          track_list_clear( &tmp.tracks );
+
+          provider->Release( provider );
+     }
+
+     return NULL;
+}
+
+static void run_analysis()
+{
+     DirectThread **threads;
+     GainResult    *result, *result_next, *other;
+     double       **blocks;
+     int           *num_blocks;
+     double         seconds = 0;
+     long long      t0, wall;
+     int            i;
+
+     direct_mutex_init( &analysis.lock );
+
+     analysis.next = 0;
+
+     threads = D_CALLOC( analyze, sizeof(DirectThread*) );
+     if (!threads) {
+          D_OOM();
+          return;
+     }
+
+     t0 = direct_clock_get_micros();
+
+     /* one track at a time per thread */
+     for (i = 0; i < analyze; i++)
+          threads[i] = direct_thread_create( DTT_DEFAULT, analysis_thread, NULL, "Loudness Analysis" );
+
+     for (i = 0; i < analyze; i++) {
+          direct_thread_join( threads[i] );
+          direct_thread_destroy( threads[i] );
+     }
+
+     wall = direct_clock_get_micros() - t0;
+
+     D_FREE( threads );
+
+     blocks     = D_CALLOC( analysis.analyzed + 1, sizeof(double*) );
+     num_blocks = D_CALLOC( analysis.analyzed + 1, sizeof(int) );
+     if (!blocks || !num_blocks)
+          D_OOM();
+
+     /* album loudness over the gating blocks of all tracks of the album, computed at its first track */
+     direct_list_foreach (result, analysis.results) {
+          struct stat st;
+          GainEntry  *entry;
+
+          if (!blocks || !num_blocks)
+               break;
+
+          if (!result->album_done) {
+               int   sets = 0;
+               float album_gain;
+
+               for (other = result; other; other = (GainResult*) other->link.next) {
+                    if (!other->album_done && !strcmp( other->album, result->album )) {
+                         blocks[sets]     = other->blocks;
+                         num_blocks[sets] = other->num_blocks;
+                         sets++;
+                    }
+               }
+
+               album_gain = loudness_gain( loudness_integrate( blocks, num_blocks, sets ) );
+
+               for (other = result; other; other = (GainResult*) other->link.next) {
+                    if (!other->album_done && !strcmp( other->album, result->album )) {
+                         other->album_gain = album_gain;
+                         other->album_done = 1;
+                    }
+               }
+          }
+
+          seconds += result->seconds;
+
+          if (stat( result->media->mrl, &st ))
+               continue;
+
+          entry = gain_cache_add( result->media->mrl, st.st_size, st.st_mtime, result->id );
+          if (entry) {
+               entry->track_gain = result->track_gain;
+               entry->album_gain = result->album_gain;
+          }
+
+          if (!quiet)
+               fprintf( stderr, "Analyzed %s track %u: track gain %.2f dB, album gain %.2f dB\n", result->media->mrl,
+                        result->id, 20 * log10( result->track_gain ), 20 * log10( result->album_gain ) );
+     }
+
+     if (blocks)
+          D_FREE( blocks );
+     if (num_blocks)
+          D_FREE( num_blocks );
+
+     direct_list_foreach_safe (result, result_next, analysis.results) {
+          if (result->blocks)
+               D_FREE( result->blocks );
+          D_FREE( result );
+     }
+
+     analysis.results = NULL;
+
+     direct_mutex_deinit( &analysis.lock );
+
+     if (analysis.analyzed) {
+          gain_cache_prune();
+          gain_cache_save();
+     }
+
+     fprintf( stderr, "Analysis: %d tracks (%d skipped) with %d threads, %.1f s of audio in %lld.%03lld s, "
+              "%.1fx realtime, %.2f tracks/s\n", analysis.analyzed, analysis.skipped, analyze, seconds,
+              wall / 1000000, wall / 1000 % 1000, wall ? seconds * 1000000 / wall : 0.0,
+              wall ? analysis.analyzed * 1000000.0 / wall : 0.0 );
+}
+
+/******************************************************************************/
+
+static DirectResult control_open()
+{
+     struct sockaddr_un addr;
+     struct stat        st;
+
+     if (strlen( control_path ) >= sizeof(addr.sun_path)) {
+          fprintf( stderr, "Control socket path '%s' is too long!\n", control_path );
+          return DR_INVARG;
+     }
+
+     control.listen_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+     if (control.listen_fd < 0) {
+          perror( "socket" );
+          return DR_FAILURE;
+     }
+
+     memset( &addr, 0, sizeof(addr) );
+     addr.sun_family = AF_UNIX;
+     strcpy( addr.sun_path, control_path );
+
+     /* only replace a stale socket, never another file */
+     if (!lstat( control_path, &st ) && S_ISSOCK( st.st_mode ))
+          unlink( control_path );
+
+     if (bind( control.listen_fd, (struct sockaddr*) &addr, sizeof(addr) ) || listen( control.listen_fd, 4 )) {
+          fprintf( stderr, "Failed to listen on control socket '%s'!\n", control_path );
+          close( control.listen_fd );
+          control.listen_fd = -1;
+          return DR_FAILURE;
+     }
+
+     return DR_OK;
+}
+
+static void control_close()
+{
+     if (control.client_fd >= 0)
+          close( control.client_fd );
+
+     if (control.listen_fd >= 0) {
+          close( control.listen_fd );
+          unlink( control_path );
+     }
+
+     control.client_fd = control.listen_fd = -1;
+}
+
+static void control_reply( const char *format, ... )
+{
+     char    buf[256];
+     va_list args;
+     int     len;
+
+     if (control.client_fd < 0)
+          return;
+
+     va_start( args, format );
+     len = vsnprintf( buf, sizeof(buf), format, args );
+     va_end( args );
+
+     send( control.client_fd, buf, MIN( len, (int) sizeof(buf) - 1 ), MSG_NOSIGNAL | MSG_DONTWAIT );
+}
+
+/* wait for terminal input, control socket activity or the timeout in ms */
+static void control_poll( int timeout )
+{
+     struct pollfd fds[3];
+     int           count = 0;
+     int           i;
+
+     if (isatty( STDIN_FILENO )) {
+          fds[count].fd     = STDIN_FILENO;
+          fds[count].events = POLLIN;
+          count++;
+     }
+
+     if (control.listen_fd >= 0) {
+          fds[count].fd     = control.listen_fd;
+          fds[count].events = POLLIN;
+          count++;
+     }
+
+     if (control.client_fd >= 0) {
+          fds[count].fd     = control.client_fd;
+          fds[count].events = POLLIN;
+          count++;
+     }
+
+     if (poll( fds, count, timeout ) <= 0)
+          return;
+
+     for (i = 0; i < count; i++) {
+          if (!fds[i].revents)
+               continue;
+
+          if (fds[i].fd == control.listen_fd) {
+               int fd = accept( control.listen_fd, NULL, NULL );
+
+               /* a new controller replaces the previous one */
+               if (fd >= 0) {
+                    if (control.client_fd >= 0)
+                         close( control.client_fd );
+
+                    control.client_fd = fd;
+                    control.len       = 0;
+               }
+          }
+          else if (fds[i].fd == control.client_fd) {
+               int ret = recv( control.client_fd, control.buf + control.len, sizeof(control.buf) - 1 - control.len,
+                               MSG_DONTWAIT );
+
+               if (ret <= 0) {
+                    close( control.client_fd );
+                    control.client_fd = -1;
+                    control.len       = 0;
+               }
+               else {
+                    control.len      += ret;
+                    control.received  = direct_clock_get_micros();
+
+                    /* drop a line that does not fit */
+                    if (control.len == sizeof(control.buf) - 1 && !memchr( control.buf, '\n', control.len ))
+                         control.len = 0;
+               }
+          }
+     }
+}
+
+/* get the next command, as a key of the terminal interface or a control code with an argument */
+static int control_next( double *ret_arg )
+{
+     static const struct {
+          const char *name;
+          int         code;
+     } commands[] = {
+          { "play",   'p'            },
+          { "stop",   's'            },
+          { "next",   '>'            },
+          { "prev",   '<'            },
+          { "loop",   'l'            },
+          { "repeat", 'r'            },
+          { "quit",   'q'            },
+          { "seek",   CONTROL_SEEK   },
+          { "volume", CONTROL_VOLUME },
+          { "pitch",  CONTROL_PITCH  },
+          { "status", CONTROL_STATUS }
+     };
+
+     char         *end;
+     char          name[16];
+     int           code = 0;
+     unsigned int  i;
+
+     while (!code) {
+          end = memchr( control.buf, '\n', control.len );
+          if (!end)
+               return 0;
+
+          *end     = 0;
+          *ret_arg = 0;
+
+          if (sscanf( control.buf, "%15s %lf", name, ret_arg ) >= 1) {
+               for (i = 0; i < D_ARRAY_SIZE(commands); i++) {
+                    if (!strcmp( name, commands[i].name ))
+                         code = commands[i].code;
+               }
+
+               if (!code)
+                    control_reply( "ERR unknown command '%s'\n", name );
+          }
+
+          control.len -= end + 1 - control.buf;
+          memmove( control.buf, end + 1, control.len );
+     }
+
+     return code;
+}
+
+/* acknowledge a command once its effect has been applied */
+static void control_done( int code )
+{
+     long long latency = direct_clock_get_micros() - control.received;
+
+     control.commands++;
+     control.latency_sum += latency;
+     control.latency_max  = MAX( control.latency_max, latency );
+
+     if (code != CONTROL_STATUS)
+          control_reply( "OK %lld.%03lld ms\n", latency / 1000, latency % 1000 );
+}
+
+/******************************************************************************/
+
+static void *crossfade_thread( DirectThread *thread, void *arg )
+{
+     long long t0           = direct_clock_get_micros();
+     long long cpu0         = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID );
+     int       out_underrun = 0;
+     int       in_underrun  = 0;
+
+     /* the ramps are applied by the faders, check both streams for underruns until the ending track is faded out */
+     while (1) {
+          FSMusicProviderStatus status  = FMSTATE_UNKNOWN;
+          int                   filled  = 0;
+          int                   total   = 0;
+          int                   read    = 0;
+          int                   write   = 0;
+          bool                  playing = false;
+          int                   done;
+
+          direct_mutex_lock( &xfade.fader->lock );
+
+          if (!xfade.fader->done)
+               direct_waitqueue_wait_timeout( &xfade.fader->cond, &xfade.fader->lock, CROSSFADE_POLL * 1000 );
+
+          done = xfade.fader->done;
+
+          direct_mutex_unlock( &xfade.fader->lock );
+
+          xfade.provider->GetStatus( xfade.provider, &status );
+
+          if (done || status != FMSTATE_PLAY)
+               break;
+
+          xfade.stream->GetStatus( xfade.stream, &filled, &total, &read, &write, &playing );
+          if (!filled && !out_underrun)
+               xfade.underruns_out++;
+          out_underrun = !filled;
+
+          xfade.in_stream->GetStatus( xfade.in_stream, &filled, &total, &read, &write, &playing );
+          if (!filled && playing && !in_underrun)
+               xfade.underruns_in++;
+          in_underrun = !filled && playing;
+     }
+
+     /* the rest of the ending track is not written */
+     xfade.provider->Stop( xfade.provider );
+
+     xfade.count++;
+     xfade.time += direct_clock_get_micros() - t0;
+     xfade.cpu  += direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID ) - cpu0;
+
+     return NULL;
+}
+
+static void crossfade_release()
+{
+     if (xfade.thread) {
+          direct_thread_join( xfade.thread );
+          direct_thread_destroy( xfade.thread );
+          xfade.thread = NULL;
+     }
+
+     if (xfade.provider) {
+          xfade.provider->Stop( xfade.provider );
+          xfade.provider->Release( xfade.provider );
+          xfade.provider = NULL;
+     }
+
+     if (xfade.fader) {
+          fader_destroy( xfade.fader );
+          xfade.fader = NULL;
+     }
+
+     if (xfade.playback) {
+          xfade.playback->Release( xfade.playback );
+          xfade.playback = NULL;
+     }
+
+     if (xfade.stream) {
+          xfade.stream->Release( xfade.stream );
+          xfade.stream = NULL;
+     }
+
+     if (xfade.in_stream) {
+          xfade.in_stream->Release( xfade.in_stream );
+          xfade.in_stream = NULL;
+     }
+}
 
-/* FusionSound interfaces */
-static IFusionSound              *sound    = NULL;
-static IFusionSoundStream        *stream   = NULL;
-static IFusionSoundPlayback      *playback = NULL;
+/* take over the ending track with its stream and fader, the next track gets a new stream */
+static void crossfade_begin( IFusionSoundMusicProvider *provider )
+{
+     crossfade_release();
 
-/* media track struct */
-typedef struct {
-     DirectLink link;
+     xfade.provider = provider;
+     xfade.stream   = stream;
+     xfade.playback = playback;
+     xfade.fader    = track_fader;
 
-     FSTrackID  id;
-} MediaTrack;
+     stream      = NULL;
+     playback    = NULL;
+     track_fader = NULL;
+}
 
-/* media struct */
-typedef struct {
-     DirectLink  link;
+/* start the ramps once the next track is about to play, both start with the next block decoded */
+static void crossfade_attach()
+{
+     if (!xfade.provider || xfade.thread)
+          return;
 
-     const char *mrl;
-     int         id;
+     stream->AddRef( stream );
 
-     DirectLink *tracks;
-} Media;
+     xfade.in_stream = stream;
 
-/* media list */
-static DirectLink *medias = NULL;
+     fader_start_ramp( track_fader, 0 );
+     fader_start_ramp( xfade.fader, 1 );
 
-/* command line options */
-static int             quiet        = 0;
-static FSSampleFormat  sampleformat = FSSF_UNKNOWN;
-static const char     *gain         = NULL;
+     xfade.thread = direct_thread_create( DTT_DEFAULT, crossfade_thread, NULL, "Crossfade" );
+}
 
 /******************************************************************************/
 
-static DirectEnumerationResult track_cb( FSTrackID track_id, FSTrackDescription desc, void *ctx )
+/* get the timeout in ms of the status loop in event mode, -1 to block until input */
+static int event_timeout( FSMusicProviderStatus status, double pos, double len, float pitch )
 {
-     Media      *media = ctx;
-     MediaTrack *track;
+     int timeout = tick ?: -1;
 
-     track = D_CALLOC( 1, sizeof(MediaTrack) );
-     if (!track) {
-          D_OOM();
-          return DENUM_CANCEL;
+     /* wake up when the end of the track, or the start of the crossfade, is expected */
+     if (status == FMSTATE_PLAY && pitch > 0 && len > 0) {
+          int remaining = (len - pos - crossfade / 1000.0) / pitch * 1000;
+
+          /* the track may end a little after the expected time, poll until it is finished */
+          remaining = MAX( remaining, 20 );
+
+          if (timeout < 0 || remaining < timeout)
+               timeout = remaining;
      }
 
-     track->id = track_id;
+     return timeout;
+}
+
+static void print_loop_stats()
+{
+     double seconds = loop_time / 1000000.0;
 
-     direct_list_append( &media->tracks, &track->link );
+     if (!seconds)
+          return;
 
-     return DENUM_OK;
+     fprintf( stderr, "\nStatus loop (%s): %lld wakeups in %.1f s (%.1f/s), loop CPU %lld ms (%.2f%%), "
+              "process CPU %lld ms (%.2f%%)\n", event_mode ? "event" : "polling", wakeups, seconds, wakeups / seconds,
+              loop_cpu / 1000, loop_cpu / 10000.0 / seconds, total_cpu / 1000, total_cpu / 10000.0 / seconds );
 }
 
 /******************************************************************************/
@@ -97,8 +6393,42 @@ static void print_usage()
      printf( "  --quiet              Do not print tracks and progress info.\n" );
      printf( "  --depth=<bitdepth>   Select the bitdepth to use (8, 16, 24 or 32).\n" );
      printf( "  --gain=<replaygain>  Set replay gain ('track' or 'album').\n" );
+     printf( "  --event              Event-driven status loop: block until input, end of track or progress tick.\n" );
+     printf( "  --tick=<ms>          Set the progress tick of the event-driven status loop (default 1000, 0 for none).\n" );
+     printf( "  --gapless            Keep one output stream, convert tracks to it and open the next media ahead of time.\n" );
+     printf( "  --bench              Decode all tracks as fast as possible without playback and report decoding costs.\n" );
+     printf( "  --telemetry=<prefix> Sample the ring buffer and write per track telemetry to <prefix><media>.<track>.csv.\n" );
+     printf( "  --prefetch=<count>   Open and enumerate the next medias in a background thread (1 with --gapless).\n" );
+     printf( "  --buffersize=<frames> Set the ring buffer size of the output stream.\n" );
+     printf( "  --prebuffer=<frames>  Set the number of frames to buffer before playback starts.\n" );
+     printf( "  --autotune           Shrink the ring buffer on the first track until underruns appear, then back off.\n" );
+     printf( "  --meter              Show peak and RMS levels of the decoded audio next to the progress information.\n" );
+     printf( "  --analyze[=<threads>] Analyze the loudness of untagged tracks in parallel (default: one thread per core).\n" );
+     printf( "  --gain-cache=<file>  Set the loudness analysis cache (default: ~/.fs_music_sample.gain).\n" );
+     printf( "  --depth-bench        Decode all tracks natively and at every depth, report conversion costs and errors.\n" );
+     printf( "  --index[=<file>]     Keep tracks and metadata of local medias in an index (default: ~/.fs_music_sample.index).\n" );
+     printf( "  --start=<index>      Start playback at the given entry of the media list.\n" );
+     printf( "  --seek-bench[=<n>]   Seek to <n> (default 20) positions per track and report seek latency and accuracy.\n" );
+     printf( "  --control=<socket>   Accept commands on a UNIX domain socket: play, stop, next, prev, loop, repeat, quit,\n" );
+     printf( "                       seek <seconds>, volume <level>, pitch <level> and status, one per line.\n" );
+     printf( "  --crossfade=<ms>     Crossfade at the end of each track, playing the next track on a second stream\n" );
+     printf( "                       (switching tracks with <,> or the control socket does not fade).\n" );
+     printf( "  --stretch            Change the speed with *,/ without changing the pitch (0.5x to 2x).\n" );
+     printf( "  --stretch-bench      Report the CPU cost of the time-stretch from 0.5x to 2x.\n" );
+     printf( "  --dump=<file>        Write the decoded audio to a WAV file (raw PCM for other extensions) during playback.\n" );
+     printf( "  --dump-only          Decode all tracks to the --dump file as fast as possible, without playback.\n" );
+     printf( "  --dump-io=<mode>     Write the dump with 'direct' I/O or drop it from the page cache with 'fadvise'.\n" );
+     printf( "  --shuffle[=<seed>]   Play all tracks of all medias in a random order, reproducible with <seed>.\n" );
+     printf( "  --cache[=<dir>]      Decode played tracks to PCM files in the background and play them from there\n" );
+     printf( "                       (default: ~/.fs_music_sample.cache).\n" );
+     printf( "  --cache-size=<MiB>   Set the size limit of the PCM cache (default 256).\n" );
+     printf( "  --realtime[=<prio>]  Lock memory and decode with SCHED_FIFO priority <prio> (default 80).\n" );
+     printf( "  --stress[=<procs>]   Run <procs> (default one per core) CPU and memory stress processes during playback.\n" );
+     printf( "  --accounting         Report CPU time, context switches and RSS per track, codec and thread.\n" );
+     printf( "  --mix[=<streams>]    Play up to <streams> (default 16) looping medias at once and report mixer costs.\n" );
      printf( "  --help               Print usage information.\n" );
-     printf( "  --fs-help            Output FusionSound usage information.\n\n" );
+     printf( "  --fs-help            Output FusionSound usage information.\n" );
+     printf( "\nFiles ending in .m3u, .m3u8 or .pls are read as playlists.\n\n" );
      printf( "Use:\n" );
      printf( "  ESC,Q,q to quit\n" );
      printf( "  s       to stop playback\n" );
@@ -116,7 +6446,37 @@ static void print_usage()
 
 static void fs_shutdown()
 {
-     Media *media, *media_next;
+     Media *media;
+
+     realtime_shutdown();
+
+     prefetch_shutdown();
+
+     cache_shutdown();
+
+     crossfade_release();
+
+     if (track_fader) {
+          fader_destroy( track_fader );
+          track_fader = NULL;
+     }
+
+     dump_close();
+
+     control_close();
+
+     gain_cache_free();
+
+     account_free();
+
+     index_free();
+
+     shuffle_free();
+
+     pipeline_release();
+     pipeline_free_scratch();
+
+     stretch_free();
 
      if (playback) playback->Release( playback );
      if (stream)   stream->Release( stream );
@@ -125,14 +6485,10 @@ static void fs_shutdown()
      if (isatty( STDIN_FILENO ))
           tcsetattr( STDIN_FILENO, TCSADRAIN, &term );
 
-     direct_list_foreach_safe (media, media_next, medias) {
-          MediaTrack *track, *track_next;
+     for (media = playlist.medias; media < playlist.medias + playlist.count; media++)
+          track_list_clear( &media->tracks );
 
-          direct_list_foreach_safe (track, track_next, media->tracks) {
-               D_FREE( track );
-          }
-          D_FREE( media );
-     }
+     playlist_free();
 }
 
 int main( int argc, char *argv[] )
@@ -144,6 +6500,8 @@ int main( int argc, char *argv[] )
      int                          dir    = 1;
      int                          repeat = 0;
      int                          quit   = 0;
+     int                          osd_ticks;
+     long long                    load_t0;
 
      if (argc < 2) {
           print_usage();
@@ -153,7 +6511,7 @@ int main( int argc, char *argv[] )
      /* initialize FusionSound including command line parsing */
      FSCHECK(FusionSoundInit( &argc, &argv ));
 
-     int id = 0;
+     load_t0 = direct_clock_get_micros();
 
      /* parse command line */
      for (i = 1; i < argc; i++) {
@@ -191,19 +6549,172 @@ int main( int argc, char *argv[] )
                if (!strncmp( option, "-gain=", sizeof("-gain=") - 1 )) {
                     option += sizeof("-gain=") - 1;
                     gain = option;
+               } else
+               if (!strcmp( option, "-event" )) {
+                    event_mode = 1;
+               } else
+               if (!strncmp( option, "-tick=", sizeof("-tick=") - 1 )) {
+                    option += sizeof("-tick=") - 1;
+                    tick = MAX( atoi( option ), 0 );
+               } else
+               if (!strcmp( option, "-gapless" )) {
+                    gapless = 1;
+               } else
+               if (!strcmp( option, "-bench" )) {
+                    bench = 1;
+               } else
+               if (!strncmp( option, "-telemetry=", sizeof("-telemetry=") - 1 )) {
+                    option += sizeof("-telemetry=") - 1;
+                    telemetry_prefix = option;
+               } else
+               if (!strncmp( option, "-prefetch=", sizeof("-prefetch=") - 1 )) {
+                    option += sizeof("-prefetch=") - 1;
+                    prefetch = MAX( atoi( option ), 0 );
+               } else
+               if (!strncmp( option, "-buffersize=", sizeof("-buffersize=") - 1 )) {
+                    option += sizeof("-buffersize=") - 1;
+                    buffersize = MAX( atoi( option ), 0 );
+               } else
+               if (!strncmp( option, "-prebuffer=", sizeof("-prebuffer=") - 1 )) {
+                    option += sizeof("-prebuffer=") - 1;
+                    prebuffer = atoi( option );
+               } else
+               if (!strcmp( option, "-autotune" )) {
+                    autotune = 1;
+               } else
+               if (!strcmp( option, "-meter" )) {
+                    meter = 1;
+               } else
+               if (!strcmp( option, "-analyze" )) {
+                    analyze = sysconf( _SC_NPROCESSORS_ONLN );
+               } else
+               if (!strncmp( option, "-analyze=", sizeof("-analyze=") - 1 )) {
+                    option += sizeof("-analyze=") - 1;
+                    analyze = atoi( option );
+               } else
+               if (!strncmp( option, "-gain-cache=", sizeof("-gain-cache=") - 1 )) {
+                    option += sizeof("-gain-cache=") - 1;
+                    gain_cache_file = option;
+               } else
+               if (!strcmp( option, "-depth-bench" )) {
+                    depth_bench = 1;
+               } else
+               if (!strcmp( option, "-seek-bench" )) {
+                    seek_bench = 20;
+               } else
+               if (!strncmp( option, "-seek-bench=", sizeof("-seek-bench=") - 1 )) {
+                    option += sizeof("-seek-bench=") - 1;
+                    seek_bench = MAX( atoi( option ), 1 );
+               } else
+               if (!strncmp( option, "-control=", sizeof("-control=") - 1 )) {
+                    option += sizeof("-control=") - 1;
+                    control_path = option;
+               } else
+               if (!strncmp( option, "-crossfade=", sizeof("-crossfade=") - 1 )) {
+                    option += sizeof("-crossfade=") - 1;
+                    crossfade = MAX( atoi( option ), 0 );
+               } else
+               if (!strcmp( option, "-stretch" )) {
+                    time_stretch = 1;
+               } else
+               if (!strcmp( option, "-stretch-bench" )) {
+                    stretch_bench = 1;
+               } else
+               if (!strncmp( option, "-dump=", sizeof("-dump=") - 1 )) {
+                    option += sizeof("-dump=") - 1;
+                    dump_file = option;
+               } else
+               if (!strcmp( option, "-dump-only" )) {
+                    dump_only = 1;
+               } else
+               if (!strncmp( option, "-dump-io=", sizeof("-dump-io=") - 1 )) {
+                    option += sizeof("-dump-io=") - 1;
+                    dump_io = option;
+               } else
+               if (!strcmp( option, "-shuffle" )) {
+                    shuffle = 1;
+               } else
+               if (!strncmp( option, "-shuffle=", sizeof("-shuffle=") - 1 )) {
+                    option += sizeof("-shuffle=") - 1;
+                    shuffle      = 1;
+                    shuffle_seed = option;
+               } else
+               if (!strcmp( option, "-cache" )) {
+                    cache_dir = "";
+               } else
+               if (!strncmp( option, "-cache=", sizeof("-cache=") - 1 )) {
+                    option += sizeof("-cache=") - 1;
+                    cache_dir = option;
+               } else
+               if (!strncmp( option, "-cache-size=", sizeof("-cache-size=") - 1 )) {
+                    option += sizeof("-cache-size=") - 1;
+                    cache_size = MAX( atoi( option ), 1 );
+               } else
+               if (!strcmp( option, "-realtime" )) {
+                    realtime = REALTIME_PRIORITY;
+               } else
+               if (!strncmp( option, "-realtime=", sizeof("-realtime=") - 1 )) {
+                    option += sizeof("-realtime=") - 1;
+                    realtime = CLAMP( atoi( option ), 1, 99 );
+               } else
+               if (!strcmp( option, "-stress" )) {
+                    stress = sysconf( _SC_NPROCESSORS_ONLN );
+               } else
+               if (!strncmp( option, "-stress=", sizeof("-stress=") - 1 )) {
+                    option += sizeof("-stress=") - 1;
+                    stress = MAX( atoi( option ), 1 );
+               } else
+               if (!strcmp( option, "-accounting" )) {
+                    accounting = 1;
+               } else
+               if (!strcmp( option, "-mix" )) {
+                    mix = 16;
+               } else
+               if (!strncmp( option, "-mix=", sizeof("-mix=") - 1 )) {
+                    option += sizeof("-mix=") - 1;
+                    mix = MAX( atoi( option ), 1 );
+               } else
+               if (!strcmp( option, "-index" )) {
+                    index_file = "";
+               } else
+               if (!strncmp( option, "-index=", sizeof("-index=") - 1 )) {
+                    option += sizeof("-index=") - 1;
+                    index_file = option;
+               } else
+               if (!strncmp( option, "-start=", sizeof("-start=") - 1 )) {
+                    option += sizeof("-start=") - 1;
+                    start = MAX( atoi( option ), 0 );
                }
           }
+          else if (playlist_is_playlist( option )) {
+               playlist_load( option );
+          }
           else {
-               Media *media;
-
-               media = D_CALLOC( 1, sizeof(Media) );
-               media->mrl = option;
-               media->id = id++;
-               direct_list_append( &medias, &media->link );
+               playlist_add( NULL, 0, option, strlen( option ) );
           }
      }
 
-     if (!medias) {
+     if (playlist_finish())
+          return 1;
+
+     /* load time and memory of the media list as built, the track IDs are added per media during playback */
+     if (playlist.count) {
+          long long load_time = direct_clock_get_micros() - load_t0;
+          size_t    memory    = playlist_memory();
+
+          fprintf( stderr, "Media list: %d entries loaded in %lld.%03lld ms, %zu KiB (%zu bytes per entry)\n",
+                   playlist.count, load_time / 1000, load_time % 1000, memory / 1024, memory / playlist.count );
+     }
+
+     if (!playlist.count) {
+          print_usage();
+          return 1;
+     }
+
+     /* the pipeline writes to the current stream only, crossfaded tracks are written by their own faders */
+     if (crossfade && (gapless || meter || time_stretch || dump_file || realtime || cache_dir)) {
+          fprintf( stderr, "The option --crossfade can not be combined with --gapless, --meter, --stretch, --dump, "
+                   "--realtime or --cache!\n\n" );
           print_usage();
           return 1;
      }
@@ -228,41 +6739,196 @@ int main( int argc, char *argv[] )
      /* register termination function */
      atexit( fs_shutdown );
 
+     /* tracks and metadata of the medias, probed once and validated by modification time */
+     if (index_file) {
+          static char path[1024];
+
+          if (!*index_file) {
+               snprintf( path, sizeof(path), "%s/.fs_music_sample.index", getenv( "HOME" ) ?: "." );
+               index_file = path;
+          }
+
+          index_build();
+     }
+
+     /* loudness analysis of untagged tracks, cached in a sidecar file */
+     if (analyze || gain) {
+          static char path[1024];
+
+          if (!gain_cache_file) {
+               snprintf( path, sizeof(path), "%s/.fs_music_sample.gain", getenv( "HOME" ) ?: "." );
+               gain_cache_file = path;
+          }
+
+          gain_cache_load();
+
+          if (analyze > 0)
+               run_analysis();
+     }
+
+     /* offline decode benchmark */
+     if (bench) {
+          run_bench();
+          return 0;
+     }
+
+     /* sample format conversion benchmark */
+     if (depth_bench) {
+          run_depth_bench();
+          return 0;
+     }
+
+     /* seek latency and accuracy benchmark */
+     if (seek_bench) {
+          run_seek_bench();
+          return 0;
+     }
+
+     /* decoded audio capture without playback */
+     if (dump_file && dump_only) {
+          run_dump();
+          return 0;
+     }
+
+     if (time_stretch || stretch_bench)
+          direct_mutex_init( &stretch.lock );
+
+     /* time-stretch benchmark */
+     if (stretch_bench) {
+          run_stretch_bench();
+          return 0;
+     }
+
+     /* multi-stream mixer stress test */
+     if (mix) {
+          run_mix();
+          return 0;
+     }
+
+     /* the decoding thread is only known to the buffer callback, cached tracks are played to the buffer */
+     use_pipeline = gapless || meter || time_stretch || dump_file || realtime || cache_dir;
+
+     /* decoded tracks in memory-mapped files */
+     if (cache_dir) {
+          static char path[1024];
+
+          if (!*cache_dir) {
+               snprintf( path, sizeof(path), "%s/.fs_music_sample.cache", getenv( "HOME" ) ?: "." );
+               cache_dir = path;
+          }
+
+          cache_init();
+     }
+
+     if (meter)
+          direct_mutex_init( &level_meter.lock );
+
+     if (shuffle && shuffle_init())
+          shuffle = 0;
+
+     /* the next media must be ready when the current one ends, shuffle defeats sequential read-ahead */
+     if ((gapless || shuffle) && !prefetch)
+          prefetch = 1;
+
+     if (prefetch)
+          prefetch_init();
+
+     if (control_path && control_open())
+          return 1;
+
+     if (realtime || stress)
+          realtime_start();
+
+     /* progress tick: the polling interval, or the event-driven progress update when not quiet */
+     if (!event_mode)
+          tick = 40;
+     else if (tick < 0)
+          tick = quiet ? 0 : 1000;
+
+     /* volume and pitch levels are displayed for about 2 seconds */
+     osd_ticks = tick ? MAX( 2000 / tick, 2 ) : 2;
+
      do {
           Media *media, *media_next;
 
-          for (media = dir > 0 ? (Media*) medias : direct_list_get_last( medias ); media && !quit;) {
+          /* the start entry is found by index on the first pass */
+          if (shuffle)
+               media = shuffle_media();
+          else if (start < playlist.count) {
+               media = &playlist.medias[start];
+               start = playlist.count;
+          }
+          else
+               media = playlist_media( dir > 0 ? 0 : playlist.count - 1 );
+
+          for (; media && !quit;) {
                DirectResult               ret;
                FSTrackDescription         desc;
                FSStreamDescription        sdsc;
                IFusionSoundMusicProvider *music_provider;
-               MediaTrack                *track, *track_next;
+               int                        track, track_next;   /* indices in the track list, -1 for none */
                FSMusicProviderStatus      status = FMSTATE_UNKNOWN;
+               long long                  switch_t0;
+               long long                  prefetch_time = 0;
+               IFusionSoundMusicProvider *media_provider   = NULL;
+               IFusionSoundMusicProvider *cached           = NULL;
+               int                        cache_generation = 0;
 
-               media_next = (Media*) media->link.next;
+               media_next = playlist_media( media->id + 1 );
 
-               /* create a music provider */
-               ret = sound->CreateMusicProvider( sound, media->mrl, &music_provider );
-               if (ret) {
-                    media = media_next;
-                    continue;
+               /* use the music provider opened ahead of time, or create it */
+               switch_t0      = direct_clock_get_micros();
+               music_provider = prefetch ? prefetch_take( media, &prefetch_time ) : NULL;
+
+               if (music_provider) {
+                    prefetcher.hits++;
+                    prefetcher.hit_latency += direct_clock_get_micros() - switch_t0;
+                    prefetcher.saved       += prefetch_time - (direct_clock_get_micros() - switch_t0);
+               }
+               else {
+                    /* create a music provider */
+                    ret = sound->CreateMusicProvider( sound, media->mrl, &music_provider );
+                    if (ret) {
+                         media = shuffle ? shuffle_step( dir, repeat ) : media_next;
+                         continue;
+                    }
+
+                    /* play tracks, from the index if up to date */
+                    if (index_fill_tracks( media, &media->tracks ) == DR_OK) {
+                         media_index.hits++;
+                         media_index.saved += media->index->probe_time;
+                    }
+                    else
+                         FSCHECK(music_provider->EnumTracks( music_provider, track_cb, media ));
+
+                    prefetcher.misses++;
+                    prefetcher.miss_latency += direct_clock_get_micros() - switch_t0;
                }
 
-               /* play tracks */
-               FSCHECK(music_provider->EnumTracks( music_provider, track_cb, media ));
+               if (shuffle)
+                    shuffle_filter_tracks( media );
+
+               /* open the next medias in the background */
+               if (prefetch)
+                    prefetch_update( media, dir, repeat );
 
                if (!quiet)
                     fprintf( stderr, "\nMedia %d (%s):\n", media->id, media->mrl );
 
-               for (track = dir > 0 ? (MediaTrack*) media->tracks : direct_list_get_last( media->tracks ); track && !quit;) {
-                    double len       = 0;
-                    int    vol_set   = 0;
-                    int    pitch_set = 0;
+               track = media->tracks.count ? (dir > 0 ? 0 : media->tracks.count - 1) : -1;
+
+               while (track >= 0 && !quit) {
+                    FSTrackID   track_id  = media->tracks.ids[track];
+                    double      len       = 0;
+                    IndexTrack *indexed   = NULL;
+                    int         vol_set   = 0;
+                    int         pitch_set = 0;
+                    long long   t0, cpu0, total0;
 
-                    track_next = (MediaTrack*) track->link.next;
+                    track_next = track + 1 < media->tracks.count ? track + 1 : -1;
 
                     /* select current track in playlist */
-                    ret = music_provider->SelectTrack( music_provider, track->id );
+                    ret = music_provider->SelectTrack( music_provider, track_id );
                     if (ret) {
                          track = track_next;
                          continue;
@@ -273,13 +6939,41 @@ int main( int argc, char *argv[] )
                     if (sampleformat)
                          sdsc.sampleformat = sampleformat;
 
-                    /* check if the stream description needs to be changed */
-                    if (stream) {
+                    if (buffersize) {
+                         sdsc.flags      |= FSSDF_BUFFERSIZE;
+                         sdsc.buffersize  = buffersize;
+                    }
+
+                    if (prebuffer) {
+                         sdsc.flags     |= FSSDF_PREBUFFER;
+                         sdsc.prebuffer  = prebuffer;
+                    }
+
+                    /* tune the buffer size once, on the first track */
+                    if (autotune) {
+                         if (stream) {
+                              stream->Wait( stream, 0 );
+                              playback->Release( playback );
+                              playback = NULL;
+                              stream->Release( stream );
+                              stream = NULL;
+                         }
+
+                         buffersize = autotune_buffersize( music_provider, media, track_id, &sdsc );
+                         autotune   = 0;
+
+                         sdsc.flags      |= FSSDF_BUFFERSIZE;
+                         sdsc.buffersize  = buffersize;
+                    }
+
+                    /* check if the stream description needs to be changed, unless converting to the stream */
+                    if (stream && !gapless) {
                          FSStreamDescription dsc;
 
                          stream->GetDescription( stream, &dsc );
 
-                         if (dsc.channels     != sdsc.channels     ||
+                         if ((buffersize && dsc.buffersize != sdsc.buffersize) ||
+                             dsc.channels     != sdsc.channels     ||
                              dsc.sampleformat != sdsc.sampleformat ||
                              dsc.samplerate   != sdsc.samplerate) {
                               stream->Wait( stream, 0 );
@@ -302,33 +6996,102 @@ int main( int argc, char *argv[] )
                          stream->GetPlayback( stream, &playback );
                     }
 
+                    /* decode in the native format of the track and convert to the stream */
+                    if (use_pipeline) {
+                         stream->GetDescription( stream, &sdsc );
+
+                         ret = pipeline_setup( music_provider, &sdsc );
+                         if (ret) {
+                              FusionSoundError( "Pipeline setup failed", ret );
+                              break;
+                         }
+                    }
+                    else if (crossfade) {
+                         ret = fader_setup( music_provider );
+                         if (ret) {
+                              FusionSoundError( "Fader setup failed", ret );
+                              break;
+                         }
+                    }
+
                     /* get track description */
-                    music_provider->GetTrackDescription( music_provider, &desc );
+                    indexed = media->index && media->index->valid ? index_track( media->index, track_id ) : NULL;
+                    if (indexed)
+                         desc = indexed->desc;
+                    else
+                         music_provider->GetTrackDescription( music_provider, &desc );
 
                     /* reset volume level */
                     if (gain) {
+                         GainEntry *entry = NULL;
+
+                         /* use the analyzed loudness of untagged tracks */
+                         if (desc.replaygain <= 0.0)
+                              entry = gain_cache_lookup( media->mrl, track_id );
+
                          if (!strcmp( gain, "track" )) {
                               if (desc.replaygain > 0.0)
                                    volume = desc.replaygain;
+                              else if (entry)
+                                   volume = entry->track_gain;
                          }
                          else if (!strcmp( gain, "album" )) {
                               if (desc.replaygain_album > 0.0)
                                    volume = desc.replaygain_album;
+                              else if (entry)
+                                   volume = entry->album_gain;
                          }
                     }
 
                     playback->SetVolume( playback, volume );
 
                     /* reset pitch */
-                    playback->SetPitch( playback, pitch );
+                    pitch = set_pitch( pitch );
+
+                    /* fade in against the previous track */
+                    if (crossfade)
+                         crossfade_attach();
+
+                    /* account resources from the start of the track */
+                    if (accounting)
+                         account_begin();
+
+                    /* play from the PCM cache, or decode the track into it in the background */
+                    if (cache_dir) {
+                         cached = cache_open( media->mrl, track_id, &pipeline.src );
+                         if (cached) {
+                              cached->SetPlaybackFlags( cached, flags );
+
+                              media_provider = music_provider;
+                              music_provider = cached;
+                         }
+                         else
+                              cache_request( media->mrl, track_id );
+
+                         cache_generation = cache.generation;
+                    }
 
                     /* play the selected track */
-                    ret = music_provider->PlayToStream( music_provider, stream );
+                    ret = start_playback( music_provider );
                     if (ret) {
-                         FusionSoundError( "PlayToStream failed", ret );
+                         FusionSoundError( "Starting playback failed", ret );
                          break;
                     }
 
+                    realtime_set_active( 1 );
+
+                    if (switch_start) {
+                         long long latency = direct_clock_get_micros() - switch_start;
+
+                         switches++;
+                         switch_total += latency;
+                         switch_max    = MAX( switch_max, latency );
+                    }
+
+                    /* sample the ring buffer while the track is playing */
+                    if (telemetry_prefix)
+                         telemetry_start( music_provider, media, track_id );
+
                     /* print track information */
                     if (!quiet) {
                          fprintf( stderr,
@@ -341,21 +7104,45 @@ int main( int argc, char *argv[] )
                                   "  Encoding:   %s\n"
                                   "  Bitrate:    %d Kbits/s\n"
                                   "  ReplayGain: %.2f (track), %.2f (album)\n"
-                                  "  Output:     %d Hz, %d channel(s), %u bits\n\n",
-                                  media->id, track->id, desc.artist, desc.title, desc.album, desc.year, desc.genre,
+                                  "  Output:     %d Hz, %d channel(s), %u bits\n",
+                                  media->id, track_id, desc.artist, desc.title, desc.album, desc.year, desc.genre,
                                   desc.encoding, desc.bitrate / 1000, desc.replaygain, desc.replaygain_album,
                                   sdsc.samplerate, sdsc.channels, FS_BITS_PER_SAMPLE(sdsc.sampleformat) );
+
+                         if (buffersize || prebuffer) {
+                              int delay = 0;
+
+                              stream->GetPresentationDelay( stream, &delay );
+
+                              fprintf( stderr, "  Latency:    %d frames ring buffer (%d ms), %d ms presentation delay\n",
+                                       sdsc.buffersize, sdsc.buffersize * 1000 / sdsc.samplerate, delay );
+                         }
+
+                         fprintf( stderr, "\n" );
                     }
 
                     /* get track length */
-                    music_provider->GetLength( music_provider, &len );
+                    if (indexed)
+                         len = indexed->length;
+                    else
+                         music_provider->GetLength( music_provider, &len );
+
+                    t0     = direct_clock_get_micros();
+                    cpu0   = direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID );
+                    total0 = direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID );
 
                     do {
                          double pos = 0;
 
+                         wakeups++;
+
                          /* get playback status */
                          music_provider->GetStatus( music_provider, &status );
 
+                         /* query elapsed seconds */
+                         if (!quiet || event_mode || crossfade)
+                              music_provider->GetPos( music_provider, &pos );
+
                          if (!quiet) {
                               int filled = 0;
                               int total  = 0;
@@ -364,9 +7151,6 @@ int main( int argc, char *argv[] )
                               /* query ring buffer status */
                               stream->GetStatus( stream, &filled, &total, NULL, NULL, NULL );
 
-                              /* query elapsed seconds */
-                              music_provider->GetPos( music_provider, &pos );
-
                               /* print progress information */
                               fprintf( stderr, "\rTime: %02d:%02d:%02d of %02d:%02d:%02d  Ring Buffer:%3d%% ",
                                        (int) pos / 60, (int) pos % 60, (int) (pos * 100) % 100,
@@ -381,31 +7165,45 @@ int main( int argc, char *argv[] )
 
                               if (pitch_set) {
                                    if (--pitch_set)
-                                        fprintf( stderr, "[Pitch:%3d%%] ", (int) (pitch * 100) );
+                                        fprintf( stderr, time_stretch ? "[Speed:%3d%%] " : "[Pitch:%3d%%] ",
+                                                 (int) (pitch * 100) );
                                    else
                                         clear += 13;
                               }
 
+                              if (meter)
+                                   meter_print();
+
                               while (clear) {
                                    putc( ' ', stderr );
                                    clear--;
                               }
                          }
 
-                         if (isatty( STDIN_FILENO )) {
-                              int            c;
-                              fd_set         s;
-                              struct timeval t = { 0, 40000 };
+                         if (isatty( STDIN_FILENO ) || control.listen_fd >= 0) {
+                              int    c;
+                              int    timeout = tick;
+                              int    from_control;
+                              double arg;
+
+                              if (event_mode)
+                                   timeout = event_timeout( status, pos, len, pitch );
+
+                              control_poll( timeout );
 
-                              FD_ZERO( &s );
-                              FD_SET( STDIN_FILENO, &s );
+                              while (1) {
+                                   c            = isatty( STDIN_FILENO ) ? getc( stdin ) : -1;
+                                   from_control = c <= 0;
 
-                              select( STDIN_FILENO + 1, &s, NULL, NULL, &t );
+                                   if (from_control)
+                                        c = control_next( &arg );
+
+                                   if (c <= 0)
+                                        break;
 
-                              while ((c = getc( stdin )) > 0) {
                                    switch (c) {
                                         case 'p':
-                                             music_provider->PlayToStream( music_provider, stream );
+                                             start_playback( music_provider );
                                              break;
                                         case 's':
                                              if (!pitch) {
@@ -420,27 +7218,28 @@ int main( int argc, char *argv[] )
                                              break;
                                         case 'f':
                                              music_provider->GetPos( music_provider, &pos );
-                                             music_provider->SeekTo( music_provider, pos + 15 );
+                                             seek_playback( music_provider, pos + 15 );
                                              break;
                                         case 'b':
                                              music_provider->GetPos( music_provider, &pos );
-                                             music_provider->SeekTo( music_provider, pos - 15 );
+                                             seek_playback( music_provider, pos - 15 );
                                              break;
                                         case '0' ... '9':
                                              if (len)
-                                                  music_provider->SeekTo( music_provider, len * (c - '0') / 10 );
+                                                  seek_playback( music_provider, len * (c - '0') / 10 );
                                              break;
                                         case '<':
-                                             if (track == (MediaTrack*) media->tracks) {
-                                                  track_next = NULL;
-                                                  if (media == (Media*) medias)
-                                                       media_next = NULL;
-                                                  else
-                                                       media_next = (Media*) media->link.prev;
+                                             if (track == 0) {
+                                                  track_next = -1;
+                                                  media_next = playlist_media( media->id - 1 );
                                              }
                                              else
-                                                  track_next = (MediaTrack*) track->link.prev;
+                                                  track_next = track - 1;
                                         case '>':
+                                             /* point the prefetch window to the new direction */
+                                             if (prefetch && dir != (c != '<' ? 1 : -1))
+                                                  prefetch_update( media, -dir, repeat );
+
                                              dir = c != '<' ? 1 : -1;
                                              if (!pitch) {
                                                   playback->SetVolume( playback, 0 );
@@ -461,28 +7260,28 @@ int main( int argc, char *argv[] )
                                              if (volume < 0.0)
                                                   volume = 0.0;
                                              playback->SetVolume( playback, volume );
-                                             vol_set = 50;
+                                             vol_set = osd_ticks;
                                              break;
                                         case '+':
                                              volume += 1.0/32;
                                              if (volume > 64.0)
                                                   volume = 64.0;
                                              playback->SetVolume( playback, volume );
-                                             vol_set = 50;
+                                             vol_set = osd_ticks;
                                              break;
                                         case '/':
                                              pitch -= 1.0/32;
                                              if (pitch < 0.0)
                                                   pitch = 0.0;
-                                             playback->SetPitch( playback, pitch );
-                                             pitch_set = 50;
+                                             pitch = set_pitch( pitch );
+                                             pitch_set = osd_ticks;
                                              break;
                                         case '*':
                                              pitch += 1.0/32;
                                              if (pitch > 64.0)
                                                   pitch = 64.0;
-                                             playback->SetPitch( playback, pitch );
-                                             pitch_set = 50;
+                                             pitch = set_pitch( pitch );
+                                             pitch_set = osd_ticks;
                                              break;
                                         case 'q':
                                         case 'Q':
@@ -490,35 +7289,179 @@ int main( int argc, char *argv[] )
                                              quit = 1;
                                              status = FMSTATE_FINISHED;
                                              break;
+                                        case CONTROL_SEEK:
+                                             seek_playback( music_provider, MAX( arg, 0 ) );
+                                             break;
+                                        case CONTROL_VOLUME:
+                                             volume = CLAMP( arg, 0.0, 64.0 );
+                                             playback->SetVolume( playback, volume );
+                                             vol_set = osd_ticks;
+                                             break;
+                                        case CONTROL_PITCH:
+                                             pitch = CLAMP( arg, 0.0, 64.0 );
+                                             pitch = set_pitch( pitch );
+                                             pitch_set = osd_ticks;
+                                             break;
+                                        case CONTROL_STATUS:
+                                             music_provider->GetPos( music_provider, &pos );
+                                             control_reply( "STATUS %s %d.%u %.2f %.2f %.3f %.3f\n",
+                                                            status == FMSTATE_PLAY ? "play" : status == FMSTATE_STOP ?
+                                                            "stop" : "finished", media->id, track_id, pos, len,
+                                                            volume, pitch );
+                                             break;
                                         default:
                                              break;
                                    }
+
+                                   if (from_control)
+                                        control_done( c );
                               }
                          }
+                         else if (event_mode) {
+                              /* wait for the end of the track or the progress tick */
+                              if (status != FMSTATE_FINISHED)
+                                   music_provider->WaitStatus( music_provider, FMSTATE_FINISHED,
+                                                               crossfade ? MAX( event_timeout( status, pos, len,
+                                                                                               pitch ), 0 ) : tick );
+                         }
                          else {
-                              usleep( 40000 );
+                              usleep( tick * 1000 );
+                         }
+
+                         /* continue from the PCM cache as soon as the track has been decoded into it */
+                         if (cache_dir && !cached && status == FMSTATE_PLAY && cache.generation != cache_generation) {
+                              cache_generation = cache.generation;
+
+                              cached = cache_open( media->mrl, track_id, &pipeline.src );
+                              if (cached) {
+                                   music_provider->GetPos( music_provider, &pos );
+                                   music_provider->Stop( music_provider );
+
+                                   media_provider = music_provider;
+                                   music_provider = cached;
+
+                                   music_provider->SetPlaybackFlags( music_provider, flags );
+                                   music_provider->SeekTo( music_provider, pos );
+
+                                   start_playback( music_provider );
+
+                                   telemetry.provider = music_provider;
+                              }
+                         }
+
+                         /* hand the ending track over to the crossfade and continue with the next one */
+                         if (crossfade && status == FMSTATE_PLAY && len > 0 &&
+                             len - pos <= crossfade / 1000.0 && (track_next >= 0 || media_next || repeat)) {
+                              IFusionSoundMusicProvider *next_provider = NULL;
+
+                              /* the next track of the same media needs its own music provider */
+                              if (track_next < 0 || !sound->CreateMusicProvider( sound, media->mrl, &next_provider )) {
+                                   /* telemetry and the latency probe sample the current stream */
+                                   telemetry_stop();
+
+                                   realtime_set_active( 0 );
+
+                                   crossfade_begin( music_provider );
+
+                                   music_provider = next_provider;
+                                   status         = FMSTATE_FINISHED;
+                              }
                          }
                     } while (status != FMSTATE_FINISHED);
 
+                    if (gapless)
+                         pipeline_mark_end();
+
+                    telemetry_stop();
+
+                    realtime_set_active( 0 );
+
+                    switch_start = direct_clock_get_micros();
+
+                    loop_time += direct_clock_get_micros() - t0;
+                    loop_cpu  += direct_clock_get_time( DIRECT_CLOCK_THREAD_CPUTIME_ID ) - cpu0;
+                    total_cpu += direct_clock_get_time( DIRECT_CLOCK_PROCESS_CPUTIME_ID ) - total0;
+
                     if (!quiet)
                          fprintf( stderr, "\n" );
 
+                    if (accounting)
+                         account_end( desc.encoding );
+
+                    /* back to the music provider of the media */
+                    if (cached) {
+                         cached->Release( cached );
+                         cached         = NULL;
+                         music_provider = media_provider;
+                    }
+
                     track = track_next;
                }
 
-               /* release the music provider */
-               music_provider->Release( music_provider );
+               /* a cached track may have been left on error */
+               if (cached) {
+                    cached->Release( cached );
+                    music_provider = media_provider;
+               }
+
+               /* release the music provider, unless handed over to the crossfade */
+               if (music_provider)
+                    music_provider->Release( music_provider );
 
                /* release media tracks */
-               direct_list_foreach_safe (track, track_next, media->tracks) {
-                    D_FREE( track );
-               }
+               track_list_clear( &media->tracks );
 
-               media->tracks = NULL;
+               if (shuffle)
+                    media_next = shuffle_step( dir, repeat );
 
                media = media_next;
           }
      } while (repeat && !quit);
 
+     /* the summaries are printed in quiet mode as well, for unattended runs */
+     print_loop_stats();
+
+     if (accounting)
+          print_account_stats();
+
+     if (realtime || stress)
+          print_realtime_stats();
+
+     if (prefetch)
+          print_prefetch_stats();
+
+     if (switches)
+          print_switch_stats();
+
+     if (cache_dir)
+          print_cache_stats();
+
+     if (meter && level_meter.total_frames)
+          fprintf( stderr, "Level meter: %.1f us CPU per audio second (%.4f%% of a core)\n",
+                   level_meter.time * (double) level_meter.samplerate / level_meter.total_frames,
+                   level_meter.time * (double) level_meter.samplerate / level_meter.total_frames / 10000 );
+
+     if (time_stretch && stretch.frames)
+          fprintf( stderr, "Time-stretch: %.1f us per audio second per channel\n",
+                   stretch.time * (double) stretch.samplerate / stretch.frames / stretch.channels );
+
+     if (xfade.count)
+          fprintf( stderr, "Crossfade: %d overlaps, %lld ms total, CPU %.2f%% during overlaps, "
+                   "underruns %d (outgoing), %d (incoming)\n", xfade.count, xfade.time / 1000,
+                   xfade.time ? xfade.cpu * 100.0 / xfade.time : 0.0, xfade.underruns_out, xfade.underruns_in );
+
+     if (control.commands)
+          fprintf( stderr, "Control: %d commands, command to effect latency average %.3f ms, max %lld.%03lld ms\n",
+                   control.commands, control.latency_sum / 1000.0 / control.commands,
+                   control.latency_max / 1000, control.latency_max % 1000 );
+
+     if (index_file)
+          fprintf( stderr, "Index: %d medias opened without probing, %lld.%03lld ms of probing saved\n",
+                   media_index.hits, media_index.saved / 1000, media_index.saved % 1000 );
+
+     if (gapless)
+          fprintf( stderr, "Gapless: %d transitions, gap total %lld samples, max %d samples\n",
+                   pipeline.transitions, pipeline.gap_total, pipeline.gap_max );
+
      return 0;
 }